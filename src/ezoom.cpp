@@ -74,9 +74,45 @@
 
 #include "ezoom.h"
 
+#include <X11/Xatom.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined (__x86_64__) && defined (__GNUC__)
+#include <immintrin.h>
+#endif
+
 COMPIZ_PLUGIN_20090315 (ezoom, ZoomPluginVTable)
 
 
+/* Milliseconds from a clock that does not jump with the wall clock */
+static unsigned int
+currentMs ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * This toggles the functions only needed while the zoom area moves.
+ */
+static inline void
+toggleAnimationFunctions (bool state)
+{
+    ZOOM_SCREEN (screen);
+
+    zs->settled = !state;
+    zs->cScreen->preparePaintSetEnabled (zs, state);
+    zs->cScreen->donePaintSetEnabled (zs, state);
+}
+
 /*
  * This toggles paint functions. We don't need to continually run code when we
  * are not doing anything
@@ -87,9 +123,39 @@ toggleFunctions (bool state)
     ZOOM_SCREEN (screen);
 
     screen->handleEventSetEnabled (zs, state);
-    zs->cScreen->preparePaintSetEnabled (zs, state);
+    toggleAnimationFunctions (state);
+    zs->settled = false;
     zs->gScreen->glPaintOutputSetEnabled (zs, state);
-    zs->cScreen->donePaintSetEnabled (zs, state);
+
+    /* handleEvent no longer sees them */
+    if (!state && zs->rawMotionSelected)
+	zs->selectRawMotion (false);
+
+    /* Targets from before are stale by the time we zoom in again */
+    if (!state)
+    {
+	for (int s = 0; s < EZoomScreen::SourceCount; s++)
+	    zs->targets[s].pending = false;
+	zs->holdTimer.stop ();
+
+	zs->a11yTimer.stop ();
+	zs->a11yPendingFocus = EZoomScreen::AccessibleId ();
+	zs->a11yPendingCaret = EZoomScreen::AccessibleId ();
+	zs->extentQuery.cancel ();
+    }
+
+    /* Nor will it see the windows that move while we are unzoomed */
+    if (state)
+	zs->enableAccessibility ();
+    else if (zs->a11yListener && !zs->a11yIdleTimer.active ())
+    {
+	int timeout = zs->optionGetAccessibilityIdleTimeout () * 1000;
+
+	zs->extentQuery.invalidateAll ();
+	zs->a11yIdleTimer.setTimes (timeout, timeout * 5 / 4);
+	zs->a11yIdleTimer.start ();
+    }
+    zs->cScreen->damageRegionSetEnabled (zs, state);
 }
 
 /* Check if the output is valid */
@@ -205,7 +271,12 @@ EZoomScreen::ZoomArea::ZoomArea (int out) :
     yTranslate (0.0f),
     realXTranslate (0.0f),
     realYTranslate (0.0f),
-    locked (false)
+    locked (false),
+    easeXYTime (0.0f),
+    easeZTime (0.0f),
+    easeXTarget (0.0f),
+    easeYTarget (0.0f),
+    easeZTarget (1.0f)
 {
     updateActualTranslates ();
 }
@@ -221,1642 +292,5202 @@ EZoomScreen::ZoomArea::ZoomArea () :
     yTranslate (0.0f),
     realXTranslate (0.0f),
     realYTranslate (0.0f),
-    locked (false)
+    locked (false),
+    easeXYTime (0.0f),
+    easeZTime (0.0f),
+    easeXTarget (0.0f),
+    easeYTarget (0.0f),
+    easeZTarget (1.0f)
 {
 }
-/* Adjust the velocity in the z-direction.  */
-void
-EZoomScreen::adjustZoomVelocity (int out, float chunk)
+/* Move value towards target over msecs with the given motion model.
+ * Every model is solved exactly rather than stepped, so the result only
+ * depends on the total time passed and not on how it is split up into
+ * frames. rate is 1/ms for the damped and spring models, remaining is
+ * the time left of a fixed duration movement.
+ */
+static void
+integrateMotion (int     model,
+		 float   rate,
+		 float   msecs,
+		 GLfloat target,
+		 GLfloat &value,
+		 GLfloat &velocity,
+		 GLfloat &remaining)
 {
-    float d, adjust, amount;
+    float x = value - target;
+    float e, c, s, t;
+
+    switch (model)
+    {
+	case EzoomOptions::MotionModelSpring:
+	    /* Critically damped: x(t) = (x0 + (v0 + rate * x0) * t) * e^-rate*t */
+	    c = velocity + rate * x;
+	    e = exp (-rate * msecs);
+	    value = target + (x + c * msecs) * e;
+	    velocity = (velocity - rate * c * msecs) * e;
+	    break;
+	case EzoomOptions::MotionModelFixedDuration:
+	    /* Cubic from the current value and velocity that comes to rest
+	     * at the target when the remaining time runs out. */
+	    if (remaining <= msecs)
+	    {
+		value = target;
+		velocity = 0.0f;
+		remaining = 0.0f;
+		break;
+	    }
+	    s = msecs / remaining;
+	    t = remaining * velocity;
+	    value = target +
+		x * (2.0f * s * s * s - 3.0f * s * s + 1.0f) +
+		t * (s * s * s - 2.0f * s * s + s);
+	    velocity = (x * (6.0f * s * s - 6.0f * s) +
+			t * (3.0f * s * s - 4.0f * s + 1.0f)) / remaining;
+	    remaining -= msecs;
+	    break;
+	case EzoomOptions::MotionModelDamped:
+	default:
+	    e = exp (-rate * msecs);
+	    value = target + x * e;
+	    velocity = -rate * x * e;
+	    break;
+    }
+}
 
-    d = (zooms.at (out).newZoom - zooms.at (out).currentZoom) * 75.0f;
+/* Rate of the damped and spring models, based on the speed option.
+ * Tuned so both take about as long as the old stepped animation. */
+float
+EZoomScreen::motionRate ()
+{
+    if (optionGetMotionModel () == EzoomOptions::MotionModelSpring)
+	return optionGetSpeed () * 0.0009f;
 
-    adjust = d * 0.002f;
-    amount = fabs (d);
-    if (amount < 1.0f)
-	amount = 1.0f;
-    else if (amount > 5.0f)
-	amount = 5.0f;
+    return optionGetSpeed () * 0.0004f;
+}
 
-    zooms.at (out).zVelocity =
-	(amount * zooms.at (out).zVelocity + adjust) / (amount + 1.0f);
+/* Animate the zoom level towards newZoom.  */
+void
+EZoomScreen::animateZoom (int out, float msecs)
+{
+    ZoomArea &za = zooms.at (out);
 
-    if (fabs (d) < 0.1f && fabs (zooms.at (out).zVelocity) < 0.005f)
+    if (za.easeZTarget != za.newZoom)
     {
-	zooms.at (out).currentZoom = zooms.at (out).newZoom;
-	zooms.at (out).zVelocity = 0.0f;
+	za.easeZTarget = za.newZoom;
+	za.easeZTime = optionGetMotionDuration ();
     }
-    else
+
+    integrateMotion (optionGetMotionModel (), motionRate (), msecs,
+		     za.newZoom, za.currentZoom, za.zVelocity, za.easeZTime);
+
+    if (fabs (za.newZoom - za.currentZoom) < 0.001f &&
+	fabs (za.zVelocity) < 0.0001f)
     {
-	zooms.at (out).currentZoom += (zooms.at (out).zVelocity * chunk) /
-	    cScreen->redrawTime ();
+	za.currentZoom = za.newZoom;
+	za.zVelocity = 0.0f;
     }
 }
 
-/* Adjust the X/Y velocity based on target translation and real
- * translation. */
+/* Animate the real translation towards the target translation.  */
 void
-EZoomScreen::adjustXYVelocity (int out, float chunk)
+EZoomScreen::animateTranslate (int out, float msecs)
 {
-    float xdiff, ydiff;
-    float xadjust, yadjust;
-    float xamount, yamount;
-
-    zooms.at (out).xVelocity /= 1.25f;
-    zooms.at (out).yVelocity /= 1.25f;
-    xdiff =
-	(zooms.at (out).xTranslate - zooms.at (out).realXTranslate) *
-	75.0f;
-    ydiff =
-	(zooms.at (out).yTranslate - zooms.at (out).realYTranslate) *
-	75.0f;
-    xadjust = xdiff * 0.002f;
-    yadjust = ydiff * 0.002f;
-    xamount = fabs (xdiff);
-    yamount = fabs (ydiff);
-
-    if (xamount < 1.0f)
-	    xamount = 1.0f;
-    else if (xamount > 5.0)
-	    xamount = 5.0f;
-
-    if (yamount < 1.0f)
-	    yamount = 1.0f;
-    else if (yamount > 5.0)
-	    yamount = 5.0f;
-
-    zooms.at (out).xVelocity =
-	(xamount * zooms.at (out).xVelocity + xadjust) / (xamount + 1.0f);
-    zooms.at (out).yVelocity =
-	(yamount * zooms.at (out).yVelocity + yadjust) / (yamount + 1.0f);
+    ZoomArea &za = zooms.at (out);
+    GLfloat  remaining;
 
-    if ((fabs(xdiff) < 0.1f && fabs (zooms.at (out).xVelocity) < 0.005f) &&
-	(fabs(ydiff) < 0.1f && fabs (zooms.at (out).yVelocity) < 0.005f))
+    if (za.easeXTarget != za.xTranslate ||
+	za.easeYTarget != za.yTranslate)
     {
-	zooms.at (out).realXTranslate = zooms.at (out).xTranslate;
-	zooms.at (out).realYTranslate = zooms.at (out).yTranslate;
-	zooms.at (out).xVelocity = 0.0f;
-	zooms.at (out).yVelocity = 0.0f;
-	return;
+	za.easeXTarget = za.xTranslate;
+	za.easeYTarget = za.yTranslate;
+	za.easeXYTime = optionGetMotionDuration ();
     }
 
-    zooms.at (out).realXTranslate +=
-	(zooms.at (out).xVelocity * chunk) / cScreen->redrawTime ();
-    zooms.at (out).realYTranslate +=
-	(zooms.at (out).yVelocity * chunk) / cScreen->redrawTime ();
+    /* Both axes share the time left so they arrive together */
+    remaining = za.easeXYTime;
+    integrateMotion (optionGetMotionModel (), motionRate (), msecs,
+		     za.xTranslate, za.realXTranslate, za.xVelocity,
+		     remaining);
+    integrateMotion (optionGetMotionModel (), motionRate (), msecs,
+		     za.yTranslate, za.realYTranslate, za.yVelocity,
+		     za.easeXYTime);
+
+    if (fabs (za.xTranslate - za.realXTranslate) < 0.001f &&
+	fabs (za.yTranslate - za.realYTranslate) < 0.001f &&
+	fabs (za.xVelocity) < 0.0001f &&
+	fabs (za.yVelocity) < 0.0001f)
+    {
+	za.realXTranslate = za.xTranslate;
+	za.realYTranslate = za.yTranslate;
+	za.xVelocity = 0.0f;
+	za.yVelocity = 0.0f;
+    }
 }
 
 /* Animate the movement (if any) in preparation of a paint screen.  */
 void
 EZoomScreen::preparePaint (int	   msSinceLastPaint)
 {
+    /* Use the freshest pointer position for this frame, exactly once */
+    if (optionGetSamplePointerPerFrame () && (grabbed || pointerSamplePending))
+    {
+	CompPoint p = MousePoller::getCurrentPosition ();
+
+	pointerSamplePending = false;
+	if (p != mouse)
+	    updateMousePosition (p);
+    }
+
+    commitTarget ();
+
+    if (cursorRequestPending)
+	collectCursorImage ();
+
+    /* Pointer updates since the last paint only scheduled a repaint,
+     * add where the cursor is actually going to be painted now. */
+    if (cursorDamagePending)
+    {
+	CompRect r = cursorRect ();
+
+	if (r != lastCursorRect)
+	    damageZoomedRegion (CompRegion (lastCursorRect) + CompRegion (r));
+
+	lastCursorRect = r;
+	cursorDamagePending = false;
+    }
+
     if (grabbed)
     {
-	int   steps;
-	float amount, chunk;
+	unsigned int out;
 
-	amount = msSinceLastPaint * 0.05f * optionGetSpeed ();
-	steps  = amount / (0.5f * optionGetTimestep ());
-	if (!steps)
-	       	steps = 1;
-	chunk  = amount / (float) steps;
-	while (steps--)
+	for (out = 0; out < zooms.size (); out++)
 	{
-	    unsigned int out;
-	    for (out = 0; out < zooms.size (); out++)
-	    {
-		if (!isInMovement (out) || !isActive (out))
-		    continue;
+	    if (!isInMovement (out) || !isActive (out))
+		continue;
 
-		adjustXYVelocity (out, chunk);
-		adjustZoomVelocity (out, chunk);
-		zooms.at (out).updateActualTranslates ();
-		if (!isZoomed (out))
-		{
-		    zooms.at (out).xVelocity = zooms.at (out).yVelocity =
-			0.0f;
-		    grabbed &= ~(1 << zooms.at (out).output);
-		    if (!grabbed)
-		    {
-			cScreen->damageScreen ();
-			toggleFunctions (false);
-		    }
-		}
+	    animateTranslate (out, msSinceLastPaint);
+	    animateZoom (out, msSinceLastPaint);
+	    zooms.at (out).updateActualTranslates ();
+	    if (!isZoomed (out))
+	    {
+		zooms.at (out).xVelocity = zooms.at (out).yVelocity = 0.0f;
+		grabbed &= ~(1 << zooms.at (out).output);
+		if (out < sceneCaches.size ())
+		    freeSceneCache (&sceneCaches.at (out));
+		if (out < frameCopies.size ())
+		    freeFrameCopy (&frameCopies.at (out));
+		damageOutput (out);
+		if (!grabbed)
+		    toggleFunctions (false);
 	    }
 	}
 	if (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse)
 	    syncCenterToMouse ();
+
+	/* Keep the real cursor at the size bucket nearest the zoom */
+	if (hwCursorActive)
+	    updateHardwareCursor (false);
     }
 
     cScreen->preparePaint (msSinceLastPaint);
 }
 
-/* Damage screen if we're still moving.  */
+/* Damage the outputs that are still moving, settle if none are.  */
 void
 EZoomScreen::donePaint ()
 {
     if (grabbed)
     {
 	unsigned int out;
+	bool         moving = false;
+
 	for (out = 0; out < zooms.size (); out++)
 	{
 	    if (isInMovement (out) && isActive (out))
 	    {
-		cScreen->damageScreen ();
-		break;
+		damageOutput (out);
+		moving = true;
 	    }
 	}
+
+	if (!moving && !grabIndex && !cursorDamagePending)
+	    settle ();
     }
-    else if (grabIndex)
-	cScreen->damageScreen ();
-    else
+    else if (!grabIndex)
         toggleFunctions (false);
 
     cScreen->donePaint ();
 }
-/* Draws a box from the screen coordinates inx1,iny1 to inx2,iny2 */
-void
-EZoomScreen::drawBox (const GLMatrix &transform,
-		     CompOutput          *output,
-		     CompRect             box)
-{
-    GLMatrix zTransform = transform;
-    int           x1,x2,y1,y2;
-    int		  inx1, inx2, iny1, iny2;
-    int	          out = output->id ();
-
-    zTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
-    convertToZoomed (out, box.x1 (), box.y1 (), &inx1, &iny1);
-    convertToZoomed (out, box.x2 (), box.y2 (), &inx2, &iny2);
 
-    x1 = MIN (inx1, inx2);
-    y1 = MIN (iny1, iny2);
-    x2 = MAX (inx1, inx2);
-    y2 = MAX (iny1, iny2);
-    glPushMatrix ();
-    glLoadMatrixf (zTransform.getMatrix ());
-    glDisableClientState (GL_TEXTURE_COORD_ARRAY);
-    glEnable (GL_BLEND);
-    glColor4us (0x2fff, 0x2fff, 0x4fff, 0x4fff);
-    glRecti (x1,y2,x2,y1);
-    glColor4us (0x2fff, 0x2fff, 0x4fff, 0x9fff);
-    glBegin (GL_LINE_LOOP);
-    glVertex2i (x1, y1);
-    glVertex2i (x2, y1);
-    glVertex2i (x2, y2);
-    glVertex2i (x1, y2);
-    glEnd ();
-    glColor4usv (defaultColor);
-    glDisable (GL_BLEND);
-    glEnableClientState (GL_TEXTURE_COORD_ARRAY);
-    glPopMatrix ();
-}
-/* Apply the zoom if we are grabbed.
- * Make sure to use the correct filter.
+/* Damage on a zoomed output is reported in unzoomed coordinates, but it
+ * reaches the screen through the zoom. Map it so partial repaints put the
+ * right part of the output on screen, and collect the unzoomed damage
+ * for the scene cache.
  */
-bool
-EZoomScreen::glPaintOutput (const GLScreenPaintAttrib &attrib,
-			   const GLMatrix	     &transform,
-			   const CompRegion	     &region,
-			   CompOutput 		     *output,
-			   unsigned int		     mask)
+void
+EZoomScreen::damageRegion (const CompRegion &region)
 {
-    bool status;
-    int	 out = output->id ();
+    CompRegion   r = region;
+    CompRegion   zoomedDamage;
+    unsigned int out;
 
-    if (isActive (out))
+    if (damageIsZoomed)
     {
-	GLScreenPaintAttrib sa = attrib;
-	GLMatrix            zTransform = transform;
+	cScreen->damageRegion (region);
+	return;
+    }
 
-	mask &= ~PAINT_SCREEN_REGION_MASK;
-	mask |= PAINT_SCREEN_CLEAR_MASK;
+    for (out = 0; out < zooms.size (); out++)
+    {
+	if (!isActive (out))
+	    continue;
 
-	zTransform.scale (1.0f / zooms.at (out).currentZoom,
-		          1.0f / zooms.at (out).currentZoom,
-		          1.0f);
-	zTransform.translate (zooms.at (out).xtrans,
-			      zooms.at (out).ytrans,
-			      0);
+	CompRegion outRegion (screen->outputDevs ().at (out));
 
-	mask |= PAINT_SCREEN_TRANSFORMED_MASK;
+	if (!region.intersects (outRegion))
+	    continue;
 
-	status = gScreen->glPaintOutput (sa, zTransform, region, output, mask);
+	CompRegion damaged = region.intersected (outRegion);
 
-	drawCursor (output, transform);
+	if (out < sceneCaches.size () && sceneCaches.at (out).isSet)
+	    sceneCaches.at (out).damage += damaged;
 
+	if (out < frameCopies.size () && frameCopies.at (out).isSet)
+	    frameCopies.at (out).damage += damaged;
+
+	r -= outRegion;
+	zoomedDamage += zoomedRegion (out, damaged);
     }
-    else
-    {
-	status = gScreen->glPaintOutput (attrib, transform, region, output,
-									mask);
-    }
-    if (grabIndex)
-	drawBox (transform, output, box);
 
-    return status;
+    cScreen->damageRegion (r + zoomedDamage);
 }
 
-/* Makes sure we're not attempting to translate too far.
- * We are restricted to 0.5 to not go beyond the end
- * of the screen/head.  */
-static inline void
-constrainZoomTranslate ()
+/* Damage a region that is already in zoomed (on screen) coordinates,
+ * such as the faux-cursor. This bypasses the mapping in damageRegion.
+ */
+void
+EZoomScreen::damageZoomedRegion (const CompRegion &region)
+{
+    damageIsZoomed = true;
+    cScreen->damageRegion (region);
+    damageIsZoomed = false;
+}
+
+/* Damage all of an output, for when the zoom on it changes */
+void
+EZoomScreen::damageOutput (int out)
 {
+    damageZoomedRegion (CompRegion (screen->outputDevs ().at (out)));
+}
+
+/* The on screen area covered by the zoom box, on every output */
+CompRegion
+EZoomScreen::boxRegion ()
+{
+    CompRegion   region;
+    int          x1, y1, x2, y2;
     unsigned int out;
-    ZOOM_SCREEN (screen);
 
-    for (out = 0; out < zs->zooms.size (); out++)
+    for (out = 0; out < screen->outputDevs ().size (); out++)
     {
-	if (zs->zooms.at (out).xTranslate > 0.5f)
-	    zs->zooms.at (out).xTranslate = 0.5f;
-	else if (zs->zooms.at (out).xTranslate < -0.5f)
-	    zs->zooms.at (out).xTranslate = -0.5f;
+	convertToZoomed (out, box.x1 (), box.y1 (), &x1, &y1);
+	convertToZoomed (out, box.x2 (), box.y2 (), &x2, &y2);
 
-	if (zs->zooms.at (out).yTranslate > 0.5f)
-	    zs->zooms.at (out).yTranslate = 0.5f;
-	else if (zs->zooms.at (out).yTranslate < -0.5f)
-	    zs->zooms.at (out).yTranslate = -0.5f;
+	CompRect r (MIN (x1, x2) - 1, MIN (y1, y2) - 1,
+		    abs (x2 - x1) + 2, abs (y2 - y1) + 2);
+
+	region += CompRegion (r).intersected (screen->outputDevs ().at (out));
     }
+
+    return region;
 }
 
-/* Functions for adjusting the zoomed area.
- * These are the core of the zoom plug-in; Anything wanting
- * to adjust the zoomed area must use setCenter or setZoomArea
- * and setScale or front ends to them.  */
+/* Free the texture and framebuffer of a scene cache */
+void
+EZoomScreen::freeSceneCache (SceneCache *cache)
+{
+    if (!cache->isSet)
+	return;
 
-/* Sets the center of the zoom area to X,Y.
- * We have to be able to warp the pointer here: If we are moved by
- * anything except mouse movement, we have to sync the
- * mouse pointer. This is to allow input, and is NOT necessary
- * when input redirection is available to us or if we're cheating
- * and using a scaled mouse cursor to imitate IR.
- * The center is not the center of the screen. This is the target-center;
- * that is, it's the point that's the same regardless of zoom level.
+    cache->isSet = false;
+    GL::deleteFramebuffers (1, &cache->fbo);
+    glDeleteTextures (1, &cache->texture);
+    cache->fbo = 0;
+    cache->texture = 0;
+    cache->damage = CompRegion ();
+}
+
+/* Create (if necessary) the offscreen texture and framebuffer for the
+ * output. A freshly created cache is marked as completely damaged.
+ * Returns false if the cache can not be used.
  */
-void
-EZoomScreen::setCenter (int x, int y, bool instant)
+bool
+EZoomScreen::updateSceneCache (SceneCache *cache,
+			       CompOutput *output)
 {
-    int         out = screen->outputDeviceForPoint (x, y);
-    CompOutput  *o = &screen->outputDevs ().at (out);
+    GLenum status;
 
-    if (zooms.at (out).locked)
-	return;
+    if (cache->isSet &&
+	cache->width == output->width () &&
+	cache->height == output->height ())
+	return true;
 
-    zooms.at (out).xTranslate = (float)
-	((x - o->x1 ()) - o->width ()  / 2) / (o->width ());
-    zooms.at (out).yTranslate = (float)
-	((y - o->y1 ()) - o->height () / 2) / (o->height ());
+    freeSceneCache (cache);
 
-    if (instant)
+    cache->width = output->width ();
+    cache->height = output->height ();
+
+    glGenTextures (1, &cache->texture);
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, cache->texture);
+    glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+		     GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+		     GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D (GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, cache->width,
+		  cache->height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, 0);
+
+    GL::genFramebuffers (1, &cache->fbo);
+    GL::bindFramebuffer (GL_FRAMEBUFFER_EXT, cache->fbo);
+    GL::framebufferTexture2D (GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
+			      GL_TEXTURE_RECTANGLE_ARB, cache->texture, 0);
+    status = GL::checkFramebufferStatus (GL_FRAMEBUFFER_EXT);
+    GL::bindFramebuffer (GL_FRAMEBUFFER_EXT, 0);
+
+    cache->isSet = true;
+
+    if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
     {
-	zooms.at (out).realXTranslate = zooms.at (out).xTranslate;
-	zooms.at (out).realYTranslate = zooms.at (out).yTranslate;
-	zooms.at (out).yVelocity = 0.0f;
-	zooms.at (out).xVelocity = 0.0f;
-	zooms.at (out).updateActualTranslates ();
+	compLogMessage ("ezoom", CompLogLevelWarn,
+			"scene cache framebuffer incomplete (0x%x), "
+			"falling back to regular painting", status);
+	freeSceneCache (cache);
+	canCacheScene = false;
+	return false;
     }
 
-    if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
-	restrainCursor (out);
+    cache->damage = CompRegion (*output);
+
+    return true;
 }
 
-/* Zooms the area described.
- * The math could probably be cleaned up, but should be correct now. */
-void
-EZoomScreen::setZoomArea (int        x,
-	     		 int        y,
-	     		 int        width,
-	     		 int        height,
-	     		 bool       instant)
+/* Paint the zoomed output from its scene cache.
+ * Damaged parts of the cache are repainted unzoomed first, then the whole
+ * cache is drawn as one quad with the zoom transform applied.
+ * Returns false if the caller has to fall back to regular painting.
+ */
+bool
+EZoomScreen::paintSceneCache (const GLScreenPaintAttrib &attrib,
+			      const GLMatrix            &transform,
+			      const GLMatrix            &zTransform,
+			      CompOutput                *output,
+			      unsigned int              mask)
 {
-    CompWindow::Geometry outGeometry (x, y, width, height, 0);
-    int         out = screen->outputDeviceForGeometry (outGeometry);
-    CompOutput  *o = &screen->outputDevs ().at (out);
+    GLMatrix sTransform = zTransform;
+    int      out = output->id ();
+    int      x1, y1, x2, y2;
 
-    if (zooms.at (out).newZoom == 1.0f)
-	return;
+    if (!canCacheScene)
+	return false;
 
-    if (zooms.at (out).locked)
-	return;
-    zooms.at (out).xTranslate =
-	 (float) -((o->width () / 2) - (x + (width / 2) - o->x1 ()))
-	/ (o->width ());
-    zooms.at (out).xTranslate /= (1.0f - zooms.at (out).newZoom);
-    zooms.at (out).yTranslate =
-	(float) -((o->height () / 2) - (y + (height / 2) - o->y1 ()))
-	/ (o->height ());
-    zooms.at (out).yTranslate /= (1.0f - zooms.at (out).newZoom);
-    constrainZoomTranslate ();
+    if ((unsigned int) out >= sceneCaches.size ())
+	sceneCaches.resize (screen->outputDevs ().size ());
 
-    if (instant)
+    SceneCache &sc = sceneCaches.at (out);
+
+    if (!updateSceneCache (&sc, output))
+	return false;
+
+    if (!sc.damage.isEmpty ())
     {
-	zooms.at (out).realXTranslate = zooms.at (out).xTranslate;
-	zooms.at (out).realYTranslate = zooms.at (out).yTranslate;
-	zooms.at (out).updateActualTranslates ();
+	GL::bindFramebuffer (GL_FRAMEBUFFER_EXT, sc.fbo);
+	glViewport (0, 0, sc.width, sc.height);
+
+	mask &= ~PAINT_SCREEN_FULL_MASK;
+	mask |= PAINT_SCREEN_REGION_MASK;
+
+	gScreen->glPaintOutput (attrib, transform, sc.damage, output, mask);
+
+	GL::bindFramebuffer (GL_FRAMEBUFFER_EXT, 0);
+	glViewport (output->x1 (), screen->height () - output->y2 (),
+		    output->width (), output->height ());
+
+	sc.damage = CompRegion ();
     }
 
-    if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
-	restrainCursor (out);
-}
+    x1 = output->x1 ();
+    y1 = output->y1 ();
+    x2 = output->x2 ();
+    y2 = output->y2 ();
 
-/* Moves the zoom area to the window specified */
-void
-EZoomScreen::areaToWindow (CompWindow *w)
-{
-    int left = w->serverX () - w->border ().left;
-    int width = w->width () + w->border ().left + w->border ().right;
-    int top = w->serverY () - w->border ().top;
-    int height = w->height ()  + w->border ().top + w->border ().bottom;
+    sTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
 
-    setZoomArea (left, top, width, height, false);
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, sc.texture);
+    glTexParameteri (GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER,
+		     gScreen->textureFilter ());
+    glTexParameteri (GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER,
+		     gScreen->textureFilter ());
+
+    /* The framebuffer is upside down compared to screen coordinates */
+    overlayVertices.clear ();
+    overlayQuad (x1, y1, x2, y2, 0, sc.height, sc.width, 0, true,
+		 defaultColor);
+    flushOverlay (sTransform, GL_TEXTURE_RECTANGLE_ARB, sc.texture, false);
+
+    return true;
 }
 
-/* Pans the zoomed area vertically/horizontally by * value * zs->panFactor
- * TODO: Fix output. */
+/* The current pan of the output in whole pixels on screen */
 void
-EZoomScreen::panZoom (int xvalue, int yvalue)
+EZoomScreen::panOffset (int out, int *panX, int *panY)
 {
-    unsigned int out;
-
-    for (out = 0; out < zooms.size (); out++)
-    {
-	zooms.at (out).xTranslate +=
-	    optionGetPanFactor () * xvalue *
-	    zooms.at (out).currentZoom;
-	zooms.at (out).yTranslate +=
-	    optionGetPanFactor () * yvalue *
-	    zooms.at (out).currentZoom;
-    }
+    CompOutput *o = &screen->outputDevs ().at (out);
+    ZoomArea   &za = zooms.at (out);
 
-    constrainZoomTranslate ();
+    *panX = floor (za.realXTranslate * (1.0f - za.currentZoom) *
+		   o->width () / za.currentZoom + 0.5f);
+    *panY = floor (za.realYTranslate * (1.0f - za.currentZoom) *
+		   o->height () / za.currentZoom + 0.5f);
 }
 
-/* Enables polling of mouse position, and refreshes currently
- * stored values.
- */
+/* Free the texture of a frame copy */
 void
-EZoomScreen::enableMousePolling ()
+EZoomScreen::freeFrameCopy (FrameCopy *copy)
 {
-    pollHandle.start ();
-    lastChange = time(NULL);
-    mouse = MousePoller::getCurrentPosition ();
+    if (!copy->isSet)
+	return;
+
+    copy->isSet = false;
+    glDeleteTextures (1, &copy->texture);
+    copy->texture = 0;
+    copy->damage = CompRegion ();
 }
 
-void
-EZoomScreen::enableAccessibility ()
+/* Plugins loaded before this one that are known to leave the output
+ * alone in glPaintOutput. Anything else might draw over the zoomed
+ * output there, like showmouse or annotate do.  */
+static const char *quietPlugins[] = {
+    "core", "composite", "opengl", "mousepoll", "ccp", "dbus", "glib",
+    "regex", "text", "compiztoolbox", "imgpng", "imgsvg", "imgjpeg",
+    "session", "gnomecompat", "workarounds", "place", "decor", "move",
+    "fade", "accessibility"
+};
+
+/* Whether whatever is painted below us in glPaintOutput is the zoomed
+ * output alone. A copy of the frame would keep what other plugins drew
+ * over it and shift it about while panning, and the newly exposed parts
+ * are painted without their glPaintOutput. So reusing frames is only
+ * done if every plugin further down the paint chain, loaded before this
+ * one, is known not to draw there.  */
+bool
+EZoomScreen::paintsOutputAlone ()
 {
-    ;
+    bool below = false;
+
+    /* Newest first, the ones after us are below us */
+    foreach (CompPlugin *p, CompPlugin::getPlugins ())
+    {
+	const CompString &name = p->vTable->name ();
+	unsigned int     i;
+
+	if (!below)
+	{
+	    below = name == "ezoom";
+	    continue;
+	}
+
+	for (i = 0; i < sizeof (quietPlugins) / sizeof (quietPlugins[0]); i++)
+	    if (name == quietPlugins[i])
+		break;
+
+	if (i == sizeof (quietPlugins) / sizeof (quietPlugins[0]))
+	    return false;
+    }
+
+    return true;
 }
 
-/* Sets the zoom (or scale) level.
- * Cleans up if we are suddenly zoomed out.
- */
+/* Keep a copy of the zoomed output as it was just painted, before the
+ * cursor and zoom box are drawn on top of it. See paintPanBlit.  */
 void
-EZoomScreen::setScale (int out, float value)
+EZoomScreen::copyFrame (CompOutput *output, int panX, int panY)
 {
-    if (zooms.at (out).locked)
-	return;
+    int out = output->id ();
 
-    if (value >= 1.0f)
-	value = 1.0f;
+    if ((unsigned int) out >= frameCopies.size ())
+	frameCopies.resize (screen->outputDevs ().size ());
+
+    FrameCopy &fc = frameCopies.at (out);
+
+    if (fc.isSet &&
+	(fc.width != output->width () || fc.height != output->height ()))
+	freeFrameCopy (&fc);
+
+    if (!fc.isSet)
+    {
+	fc.isSet = true;
+	fc.width = output->width ();
+	fc.height = output->height ();
+
+	glGenTextures (1, &fc.texture);
+	glBindTexture (GL_TEXTURE_RECTANGLE_ARB, fc.texture);
+	glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+			 GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+			 GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+			 GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+			 GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D (GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, fc.width,
+		      fc.height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+    }
     else
     {
-	if (!pollHandle.active ())
-	    enableMousePolling ();
-	grabbed |= (1 << zooms.at (out).output);
-	cursorZoomActive (out);
+	glBindTexture (GL_TEXTURE_RECTANGLE_ARB, fc.texture);
     }
 
-    if (value == 1.0f)
+    glCopyTexSubImage2D (GL_TEXTURE_RECTANGLE_ARB, 0, 0, 0,
+			 output->x1 (), screen->height () - output->y2 (),
+			 fc.width, fc.height);
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, 0);
+
+    fc.panX = panX;
+    fc.panY = panY;
+    fc.zoom = zooms.at (out).currentZoom;
+    fc.damage = CompRegion ();
+}
+
+#define PAN_BLIT_MAX_RECTS 8 // painted one by one, more is not worth it
+
+/* Reuse the previous frame of an output that is only being panned.
+ * The copy is drawn shifted by the change in pan, then only the newly
+ * exposed strips and whatever was damaged since are painted. Each pixel
+ * is drawn once, either from the copy or by painting windows scissored
+ * to it, or translucent windows would be blended twice.
+ * Returns false if the whole output has to be painted.
+ */
+bool
+EZoomScreen::paintPanBlit (const GLScreenPaintAttrib &attrib,
+			   const GLMatrix            &transform,
+			   const GLMatrix            &zTransform,
+			   CompOutput                *output,
+			   unsigned int              mask,
+			   int                       panX,
+			   int                       panY)
+{
+    GLMatrix   sTransform = transform;
+    CompRegion blit, repaint;
+    int        out = output->id ();
+    int        dx, dy, x1, y1;
+
+    if ((unsigned int) out >= frameCopies.size ())
+	return false;
+
+    FrameCopy &fc = frameCopies.at (out);
+
+    if (!fc.isSet || fc.zoom != zooms.at (out).currentZoom ||
+	fc.width != output->width () || fc.height != output->height ())
+	return false;
+
+    dx = fc.panX - panX;
+    dy = fc.panY - panY;
+
+    if (abs (dx) >= fc.width || abs (dy) >= fc.height)
+	return false;
+
+    x1 = output->x1 () + dx;
+    y1 = output->y1 () + dy;
+
+    /* Only the part of the copy that lands on the output */
+    blit = CompRegion (x1, y1, fc.width, fc.height) & CompRegion (*output);
+    repaint = CompRegion (*output) - blit;
+    repaint += zoomedRegion (out, fc.damage);
+    blit = blit - repaint;
+
+    if (repaint.rects ().size () > PAN_BLIT_MAX_RECTS)
+	return false;
+
+    sTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
+
+    /* The copy is upside down compared to screen coordinates */
+    overlayVertices.clear ();
+    foreach (const CompRect &r, blit.rects ())
     {
-	zooms.at (out).xTranslate = 0.0f;
-	zooms.at (out).yTranslate = 0.0f;
-	cursorZoomInactive ();
+	int sx1 = r.x1 () - x1, sx2 = r.x2 () - x1;
+	int sy1 = fc.height - (r.y1 () - y1), sy2 = fc.height - (r.y2 () - y1);
+
+	overlayQuad (r.x1 (), r.y1 (), r.x2 (), r.y2 (), sx1, sy1, sx2, sy2,
+		     true, defaultColor);
     }
+    flushOverlay (sTransform, GL_TEXTURE_RECTANGLE_ARB, fc.texture, false);
 
-    if (value < optionGetMinimumZoom ())
-	value = optionGetMinimumZoom ();
+    if (repaint.isEmpty ())
+	return true;
 
-    zooms.at (out).newZoom = value;
-    cScreen->damageScreen();
+    mask &= ~(PAINT_SCREEN_REGION_MASK | PAINT_SCREEN_CLEAR_MASK);
+    mask |= PAINT_SCREEN_TRANSFORMED_MASK;
+
+    /* The unzoomed area of a rectangle covers a bit more than it once
+     * zoomed, the scissor keeps it off the pixels taken from the copy */
+    glEnable (GL_SCISSOR_TEST);
+    foreach (const CompRect &r, repaint.rects ())
+    {
+	glScissor (r.x1 (), screen->height () - r.y2 (),
+		   r.width (), r.height ());
+
+	gScreen->glPaintTransformedOutput (attrib, zTransform,
+					   unzoomedRegion (out,
+							   CompRegion (r)),
+					   output, mask);
+    }
+    glDisable (GL_SCISSOR_TEST);
+
+    return true;
 }
 
-/* Sets the zoom factor to the bigger of the two floats supplied.
- * Convenience function for setting the scale factor for an area.
- */
-static inline void
-setScaleBigger (int out, float x, float y)
+/* Draws a box from the screen coordinates inx1,iny1 to inx2,iny2.
+ * Immediate mode fallback for drawOverlay.  */
+void
+EZoomScreen::drawBox (const GLMatrix &transform,
+		     CompOutput          *output,
+		     CompRect             box)
 {
-    ZOOM_SCREEN (screen);
-    zs->setScale (out, x > y ? x : y);
+    GLMatrix zTransform = transform;
+    CompRect      zBox = zoomedBox (output->id (), box);
+    int           x1 = zBox.x1 (), x2 = zBox.x2 ();
+    int           y1 = zBox.y1 (), y2 = zBox.y2 ();
+
+    zTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
+    glPushMatrix ();
+    glLoadMatrixf (zTransform.getMatrix ());
+    glDisableClientState (GL_TEXTURE_COORD_ARRAY);
+    glEnable (GL_BLEND);
+    glColor4us (0x2fff, 0x2fff, 0x4fff, 0x4fff);
+    glRecti (x1,y2,x2,y1);
+    glColor4us (0x2fff, 0x2fff, 0x4fff, 0x9fff);
+    glBegin (GL_LINE_LOOP);
+    glVertex2i (x1, y1);
+    glVertex2i (x2, y1);
+    glVertex2i (x2, y2);
+    glVertex2i (x1, y2);
+    glEnd ();
+    glColor4usv (defaultColor);
+    glDisable (GL_BLEND);
+    glEnableClientState (GL_TEXTURE_COORD_ARRAY);
+    glPopMatrix ();
 }
+/* The zoom box as it appears on the given output */
+CompRect
+EZoomScreen::zoomedBox (int      out,
+			CompRect box)
+{
+    int inx1, inx2, iny1, iny2;
 
-/* Mouse code...
- * This takes care of keeping the mouse in sync with the zoomed area and
- * vice versa.
- * See heading for description.
- */
+    convertToZoomed (out, box.x1 (), box.y1 (), &inx1, &iny1);
+    convertToZoomed (out, box.x2 (), box.y2 (), &inx2, &iny2);
 
-/* Syncs the center, based on translations, back to the mouse.
- * This should be called when doing non-IR zooming and moving the zoom
- * area based on events other than mouse movement.
- */
+    return CompRect (MIN (inx1, inx2), MIN (iny1, iny2),
+		     abs (inx2 - inx1), abs (iny2 - iny1));
+}
+
+/* Overlay renderer. The faux-cursor and the zoom box are drawn with one
+ * GLSL program and a single batched draw per output, instead of the
+ * immediate mode drawCursor and drawBox. The scene cache and the pan blit
+ * draw their textures through it as well. Every vertex carries a colour
+ * and a texture coordinate; the third texture coordinate selects
+ * sampling the texture over the colour. There are two programs since
+ * the texture is a rectangle one, or a 2D one from the cursor theme.
+ *
+ * The projection and the transform handed down by glPaintOutput are
+ * uniforms. The shaders are written against a few macros, defined by a
+ * prefix for the GLSL dialect the driver speaks: 1.10 or 1.40 on desktop
+ * GL, 1.00 on GLES, which has no rectangle textures.  */
+
+#define OVERLAY_VERTEX_SIZE 9 // x, y, s, t, textured, r, g, b, a
+
+enum
+{
+    OverlayGLSL110 = 0,
+    OverlayGLSL140,
+    OverlayGLSLES100
+};
+
+static const char *overlayVertexPrefix[3] = {
+    "#version 110\n"
+    "#define IN attribute\n"
+    "#define OUT varying\n",
+
+    "#version 140\n"
+    "#define IN in\n"
+    "#define OUT out\n",
+
+    "#version 100\n"
+    "#define IN attribute\n"
+    "#define OUT varying\n"
+};
+
+static const char *overlayFragmentPrefix[3] = {
+    "#version 110\n"
+    "#extension GL_ARB_texture_rectangle : enable\n"
+    "#define IN varying\n"
+    "#define FRAG_COLOR gl_FragColor\n"
+    "#define TEXTURE_2D texture2D\n"
+    "#define TEXTURE_RECT texture2DRect\n",
+
+    "#version 140\n"
+    "#define IN in\n"
+    "out vec4 fragColor;\n"
+    "#define FRAG_COLOR fragColor\n"
+    "#define TEXTURE_2D texture\n"
+    "#define TEXTURE_RECT texture\n",
+
+    "#version 100\n"
+    "precision mediump float;\n"
+    "#define IN varying\n"
+    "#define FRAG_COLOR gl_FragColor\n"
+    "#define TEXTURE_2D texture2D\n"
+};
+
+static const char *overlayVertexShader =
+    "uniform mat4 projection;\n"
+    "uniform mat4 transform;\n"
+    "IN vec2 position;\n"
+    "IN vec3 texCoord;\n"
+    "IN vec4 color;\n"
+    "OUT vec3 vTexCoord;\n"
+    "OUT vec4 vColor;\n"
+    "void main ()\n"
+    "{\n"
+    "    vTexCoord = texCoord;\n"
+    "    vColor = color;\n"
+    "    gl_Position = projection * transform *\n"
+    "                  vec4 (position, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *overlayFragmentShader[2] = {
+    "uniform sampler2DRect image;\n"
+    "IN vec3 vTexCoord;\n"
+    "IN vec4 vColor;\n"
+    "void main ()\n"
+    "{\n"
+    "    if (vTexCoord.z > 0.5)\n"
+    "        FRAG_COLOR = TEXTURE_RECT (image, vTexCoord.xy);\n"
+    "    else\n"
+    "        FRAG_COLOR = vColor;\n"
+    "}\n",
+
+    "uniform sampler2D image;\n"
+    "IN vec3 vTexCoord;\n"
+    "IN vec4 vColor;\n"
+    "void main ()\n"
+    "{\n"
+    "    if (vTexCoord.z > 0.5)\n"
+    "        FRAG_COLOR = TEXTURE_2D (image, vTexCoord.xy);\n"
+    "    else\n"
+    "        FRAG_COLOR = vColor;\n"
+    "}\n"
+};
+
+/* Compile one shader, log and return 0 on failure */
+GLuint
+EZoomScreen::compileOverlayShader (GLenum     type,
+				   const char *prefix,
+				   const char *source)
+{
+    GLuint     shader = (*createShader) (type);
+    const char *sources[2] = { prefix, source };
+    GLint      status;
+
+    (*shaderSource) (shader, 2, sources, NULL);
+    (*compileShader) (shader);
+    (*getShaderiv) (shader, GL_COMPILE_STATUS, &status);
+
+    if (!status)
+    {
+	compLogMessage ("ezoom", CompLogLevelWarn,
+			"overlay shader failed to compile, "
+			"falling back to immediate mode");
+	(*deleteShader) (shader);
+	return 0;
+    }
+
+    return shader;
+}
+
+/* Set up the overlay programs and vertex buffer, if the driver has
+ * GLSL and buffer objects. Otherwise the immediate mode path is used. */
 void
-EZoomScreen::syncCenterToMouse ()
+EZoomScreen::initOverlay ()
 {
-    int         x, y;
-    int         out;
-    CompOutput  *o;
+    const char *version = (const char *) glGetString (GL_VERSION);
+    const char *glsl;
+    GLuint     vertexShader;
+    int        dialect = OverlayGLSL110;
+    int        major = 0, minor = 0;
 
-    out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
-    o = &screen->outputDevs ().at (out);
+    overlayProgram[0] = overlayProgram[1] = 0;
+    overlayVbo = 0;
 
-    if (!isInMovement (out))
+    if (!genBuffers || !version)
 	return;
 
-    x = (int) ((zooms.at (out).realXTranslate * o->width ()) +
-	       (o->width () / 2) + o->x1 ());
-    y = (int) ((zooms.at (out).realYTranslate * o->height ()) +
-	       (o->height () / 2) + o->y1 ());
+    if (!strncmp (version, "OpenGL ES", 9))
+	dialect = OverlayGLSLES100;
+    else if (strtol (version, NULL, 10) < 2)
+	return;
+    else
+    {
+	glsl = (const char *) glGetString (GL_SHADING_LANGUAGE_VERSION);
+	if (glsl && sscanf (glsl, "%d.%d", &major, &minor) == 2 &&
+	    (major > 1 || minor >= 40))
+	    dialect = OverlayGLSL140;
+    }
 
-    if ((x != mouse.x () || y != mouse.y ())
-	&& grabbed && zooms.at (out).newZoom != 1.0f)
+#define GETPROC(type, name) \
+    (type) (*GL::getProcAddress) ((GLubyte *) name)
+
+    createShader = GETPROC (CreateShaderProc, "glCreateShader");
+    deleteShader = GETPROC (DeleteShaderProc, "glDeleteShader");
+    shaderSource = GETPROC (ShaderSourceProc, "glShaderSource");
+    compileShader = GETPROC (CompileShaderProc, "glCompileShader");
+    getShaderiv = GETPROC (GetShaderivProc, "glGetShaderiv");
+    createProgram = GETPROC (CreateProgramProc, "glCreateProgram");
+    deleteProgram = GETPROC (DeleteProgramProc, "glDeleteProgram");
+    attachShader = GETPROC (AttachShaderProc, "glAttachShader");
+    bindAttribLocation = GETPROC (BindAttribLocationProc,
+				  "glBindAttribLocation");
+    linkProgram = GETPROC (LinkProgramProc, "glLinkProgram");
+    getProgramiv = GETPROC (GetProgramivProc, "glGetProgramiv");
+    useProgram = GETPROC (UseProgramProc, "glUseProgram");
+    getUniformLocation = GETPROC (GetUniformLocationProc,
+				  "glGetUniformLocation");
+    uniform1i = GETPROC (Uniform1iProc, "glUniform1i");
+    uniformMatrix4fv = GETPROC (UniformMatrix4fvProc, "glUniformMatrix4fv");
+    enableVertexAttribArray = GETPROC (EnableVertexAttribArrayProc,
+				       "glEnableVertexAttribArray");
+    disableVertexAttribArray = GETPROC (DisableVertexAttribArrayProc,
+					"glDisableVertexAttribArray");
+    vertexAttribPointer = GETPROC (VertexAttribPointerProc,
+				   "glVertexAttribPointer");
+
+#undef GETPROC
+
+    if (!createShader || !deleteShader || !shaderSource || !compileShader ||
+	!getShaderiv || !createProgram || !deleteProgram || !attachShader ||
+	!bindAttribLocation || !linkProgram || !getProgramiv || !useProgram ||
+	!getUniformLocation || !uniform1i || !uniformMatrix4fv ||
+	!enableVertexAttribArray || !disableVertexAttribArray ||
+	!vertexAttribPointer)
+	return;
+
+    vertexShader = compileOverlayShader (GL_VERTEX_SHADER,
+					 overlayVertexPrefix[dialect],
+					 overlayVertexShader);
+    if (!vertexShader)
+	return;
+
+    for (int i = 0; i < 2; i++)
     {
-	screen->warpPointer (x - pointerX , y - pointerY );
-	mouse.setX (x);
-	mouse.setY (y);
+	GLuint fragmentShader;
+	GLint  status;
+
+	/* Rectangle textures are desktop GL only */
+	if (i == 0 && dialect == OverlayGLSLES100)
+	    continue;
+
+	fragmentShader = compileOverlayShader (GL_FRAGMENT_SHADER,
+					       overlayFragmentPrefix[dialect],
+					       overlayFragmentShader[i]);
+	if (!fragmentShader)
+	    break;
+
+	overlayProgram[i] = (*createProgram) ();
+	(*attachShader) (overlayProgram[i], vertexShader);
+	(*attachShader) (overlayProgram[i], fragmentShader);
+	(*bindAttribLocation) (overlayProgram[i], 0, "position");
+	(*bindAttribLocation) (overlayProgram[i], 1, "texCoord");
+	(*bindAttribLocation) (overlayProgram[i], 2, "color");
+	(*linkProgram) (overlayProgram[i]);
+	(*deleteShader) (fragmentShader);
+	(*getProgramiv) (overlayProgram[i], GL_LINK_STATUS, &status);
+
+	if (!status)
+	{
+	    compLogMessage ("ezoom", CompLogLevelWarn,
+			    "overlay program failed to link, "
+			    "falling back to immediate mode");
+	    (*deleteProgram) (overlayProgram[i]);
+	    overlayProgram[i] = 0;
+	    break;
+	}
+
+	overlayProjection[i] = (*getUniformLocation) (overlayProgram[i],
+						      "projection");
+	overlayTransform[i] = (*getUniformLocation) (overlayProgram[i],
+						     "transform");
+	overlaySampler[i] = (*getUniformLocation) (overlayProgram[i], "image");
+    }
+
+    (*deleteShader) (vertexShader);
+
+    if (!overlayProgram[1] ||
+	(!overlayProgram[0] && dialect != OverlayGLSLES100))
+    {
+	finiOverlay ();
+	return;
     }
+
+    (*genBuffers) (1, &overlayVbo);
 }
 
-/* Convert the point X,Y to where it would be when zoomed.  */
 void
-EZoomScreen::convertToZoomed (int        out,
-			     int        x,
-			     int        y,
-			     int        *resultX,
-			     int        *resultY)
+EZoomScreen::finiOverlay ()
 {
-    CompOutput *o;
-
-    if (!outputIsZoomArea (out))
+    for (int i = 0; i < 2; i++)
     {
-	*resultX = x;
-	*resultY = y;
+	if (overlayProgram[i])
+	    (*deleteProgram) (overlayProgram[i]);
+	overlayProgram[i] = 0;
     }
 
-    o = &screen->outputDevs ()[out];
-    ZoomArea    &za = zooms.at (out);
-
-    x -= o->x1 ();
-    y -= o->y1 ();
-    *resultX = x - (za.realXTranslate *
-		    (1.0f - za.currentZoom) * o->width ()) - o->width () / 2;
-    *resultX /= za.currentZoom;
-    *resultX += o->width () / 2;
-    *resultX += o->x1 ();
-    *resultY = y - (za.realYTranslate *
-		    (1.0f - za.currentZoom) * o->height ()) - o->height ()/ 2;
-    *resultY /= za.currentZoom;
-    *resultY += o->height ()/ 2;
-    *resultY += o->y1 ();
+    if (overlayVbo)
+	(*deleteBuffers) (1, &overlayVbo);
+    overlayVbo = 0;
 }
 
-/* Same but use targeted translation, not real */
+/* Queue a quad of two triangles for the next overlay draw */
 void
-EZoomScreen::convertToZoomedTarget (int	  out,
-			           int	  x,
-			           int	  y,
-			           int	  *resultX,
-			           int	  *resultY)
+EZoomScreen::overlayQuad (float          x1,
+			  float          y1,
+			  float          x2,
+			  float          y2,
+			  float          s1,
+			  float          t1,
+			  float          s2,
+			  float          t2,
+			  bool           textured,
+			  const GLushort *color)
 {
-    CompOutput *o = &screen->outputDevs ().at (out);
+    const float corners[6][4] = {
+	{ x1, y1, s1, t1 }, { x1, y2, s1, t2 }, { x2, y2, s2, t2 },
+	{ x1, y1, s1, t1 }, { x2, y2, s2, t2 }, { x2, y1, s2, t1 }
+    };
 
-    if (!outputIsZoomArea (out))
+    for (int i = 0; i < 6; i++)
     {
-	*resultX = x;
-	*resultY = y;
+	overlayVertices.push_back (corners[i][0]);
+	overlayVertices.push_back (corners[i][1]);
+	overlayVertices.push_back (corners[i][2]);
+	overlayVertices.push_back (corners[i][3]);
+	overlayVertices.push_back (textured ? 1.0f : 0.0f);
+	for (int c = 0; c < 4; c++)
+	    overlayVertices.push_back (color[c] / 65535.0f);
     }
+}
 
-    ZoomArea    &za = zooms.at (out);
+/* The overlay program that samples textures of this target, or -1 if
+ * there is none and immediate mode has to do.  */
+int
+EZoomScreen::overlayProgramFor (GLenum target)
+{
+    int program = target == GL_TEXTURE_2D ? 1 : 0;
 
-    x -= o->x1 ();
-    y -= o->y1 ();
-    *resultX = x - (za.xTranslate *
-		    (1.0f - za.newZoom) * o->width ()) - o->width () / 2;
-    *resultX /= za.newZoom;
-    *resultX += o->width () / 2;
-    *resultX += o->x1 ();
-    *resultY = y - (za.yTranslate *
-		    (1.0f - za.newZoom) * o->height ()) - o->height ()/2;
-    *resultY /= za.newZoom;
-    *resultY += o->height () / 2;
-    *resultY += o->y1 ();
+    return overlayVbo && overlayProgram[program] ? program : -1;
+}
+
+/* Draw the queued quads in one go and clear the queue. The transform is
+ * in screen space already, textured vertices sample the given texture.
+ * Without an overlay program for it they are drawn in immediate mode.  */
+void
+EZoomScreen::flushOverlay (const GLMatrix &transform,
+			   GLenum         target,
+			   GLuint         texture,
+			   bool           blend)
+{
+    int          program = overlayProgramFor (target);
+    unsigned int count = overlayVertices.size () / OVERLAY_VERTEX_SIZE;
+
+    if (!count)
+	return;
+
+    if (blend)
+	glEnable (GL_BLEND);
+
+    if (texture)
+	glBindTexture (target, texture);
+
+    if (program >= 0)
+    {
+	(*useProgram) (overlayProgram[program]);
+	(*uniformMatrix4fv) (overlayProjection[program], 1, GL_FALSE,
+			     gScreen->projectionMatrix ());
+	(*uniformMatrix4fv) (overlayTransform[program], 1, GL_FALSE,
+			     transform.getMatrix ());
+	(*uniform1i) (overlaySampler[program], 0);
+
+	(*bindBuffer) (GL_ARRAY_BUFFER_ARB, overlayVbo);
+	(*bufferData) (GL_ARRAY_BUFFER_ARB,
+		       overlayVertices.size () * sizeof (GLfloat),
+		       &overlayVertices[0], GL_STREAM_DRAW_ARB);
+
+	(*vertexAttribPointer) (0, 2, GL_FLOAT, GL_FALSE,
+				OVERLAY_VERTEX_SIZE * sizeof (GLfloat),
+				(GLvoid *) 0);
+	(*vertexAttribPointer) (1, 3, GL_FLOAT, GL_FALSE,
+				OVERLAY_VERTEX_SIZE * sizeof (GLfloat),
+				(GLvoid *) (2 * sizeof (GLfloat)));
+	(*vertexAttribPointer) (2, 4, GL_FLOAT, GL_FALSE,
+				OVERLAY_VERTEX_SIZE * sizeof (GLfloat),
+				(GLvoid *) (5 * sizeof (GLfloat)));
+	for (GLuint i = 0; i < 3; i++)
+	    (*enableVertexAttribArray) (i);
+
+	glDrawArrays (GL_TRIANGLES, 0, count);
+
+	for (GLuint i = 0; i < 3; i++)
+	    (*disableVertexAttribArray) (i);
+
+	(*bindBuffer) (GL_ARRAY_BUFFER_ARB, 0);
+	(*useProgram) (0);
+    }
+    else
+    {
+	glPushMatrix ();
+	glLoadMatrixf (transform.getMatrix ());
+	if (texture)
+	    glEnable (target);
+
+	glBegin (GL_TRIANGLES);
+	for (unsigned int i = 0; i < count; i++)
+	{
+	    const GLfloat *v = &overlayVertices[i * OVERLAY_VERTEX_SIZE];
+
+	    glTexCoord2f (v[2], v[3]);
+	    glColor4f (v[5], v[6], v[7], v[8]);
+	    glVertex2f (v[0], v[1]);
+	}
+	glEnd ();
+
+	glColor4usv (defaultColor);
+	if (texture)
+	    glDisable (target);
+	glPopMatrix ();
+    }
+
+    if (texture)
+	glBindTexture (target, 0);
+
+    if (blend)
+	glDisable (GL_BLEND);
+
+    overlayVertices.clear ();
+}
+
+/* Draw the faux-cursor and/or the zoom box on top of the output */
+void
+EZoomScreen::drawOverlay (const GLMatrix &transform,
+			  CompOutput     *output,
+			  bool           withCursor,
+			  bool           withBox)
+{
+    static const GLushort boxFill[4] = { 0x2fff, 0x2fff, 0x4fff, 0x4fff };
+    static const GLushort boxOutline[4] = { 0x2fff, 0x2fff, 0x4fff, 0x9fff };
+
+    GLMatrix zTransform = transform;
+    int      out = output->id ();
+    GLenum   target = GL_TEXTURE_2D;
+
+    withCursor = withCursor && cursor.isSet && !hwCursorActive;
+
+    /*
+     * XXX: expo knows how to handle mouse when zoomed, so we back off
+     * when expo is active.
+     */
+    if (withCursor && screen->grabExist ("expo"))
+    {
+	cursorZoomInactive ();
+	withCursor = false;
+    }
+
+    if (!withCursor && !withBox)
+	return;
+
+    if (withCursor)
+	target = cursor.target;
+    else if (overlayProgramFor (target) < 0)
+	target = GL_TEXTURE_RECTANGLE_ARB;
+
+    if (overlayProgramFor (target) < 0)
+    {
+	if (withCursor)
+	    drawCursor (output, transform);
+	if (withBox)
+	    drawBox (transform, output, box);
+	return;
+    }
+
+    overlayVertices.clear ();
+
+    if (withCursor)
+    {
+	float scaleFactor = cursorScaleFactor (out);
+	float tw = cursor.width, th = cursor.height;
+	int   ax, ay;
+
+	convertToZoomed (out, mouse.x (), mouse.y (), &ax, &ay);
+
+	if (cursor.target == GL_TEXTURE_2D)
+	    tw = th = 1.0f;
+
+	overlayQuad (ax - cursor.hotX * scaleFactor,
+		     ay - cursor.hotY * scaleFactor,
+		     ax + (cursor.width - cursor.hotX) * scaleFactor,
+		     ay + (cursor.height - cursor.hotY) * scaleFactor,
+		     0, 0, tw, th, true, defaultColor);
+    }
+
+    if (withBox)
+    {
+	CompRect b = zoomedBox (out, box);
+	int      x1 = b.x1 (), y1 = b.y1 (), x2 = b.x2 (), y2 = b.y2 ();
+
+	overlayQuad (x1, y1, x2, y2, 0, 0, 0, 0, false, boxFill);
+
+	/* The outline, one pixel wide along the inside of the box */
+	overlayQuad (x1, y1, x2, y1 + 1, 0, 0, 0, 0, false, boxOutline);
+	overlayQuad (x1, y2 - 1, x2, y2, 0, 0, 0, 0, false, boxOutline);
+	overlayQuad (x1, y1 + 1, x1 + 1, y2 - 1, 0, 0, 0, 0, false,
+		     boxOutline);
+	overlayQuad (x2 - 1, y1 + 1, x2, y2 - 1, 0, 0, 0, 0, false,
+		     boxOutline);
+    }
+
+    zTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
+
+    flushOverlay (zTransform, target, withCursor ? cursor.texture : 0, true);
+}
+
+/* Apply the zoom if we are grabbed.
+ * Make sure to use the correct filter.
+ */
+bool
+EZoomScreen::glPaintOutput (const GLScreenPaintAttrib &attrib,
+			   const GLMatrix	     &transform,
+			   const CompRegion	     &region,
+			   CompOutput 		     *output,
+			   unsigned int		     mask)
+{
+    bool status;
+    int	 out = output->id ();
+
+    if (isActive (out))
+    {
+	GLScreenPaintAttrib sa = attrib;
+	GLMatrix            zTransform = transform;
+	ZoomArea            &za = zooms.at (out);
+	GLfloat             xtrans = za.xtrans;
+	GLfloat             ytrans = za.ytrans;
+	int                 panX = 0, panY = 0;
+	bool                transformed = mask & PAINT_SCREEN_TRANSFORMED_MASK;
+	bool                fullPaint = false;
+	bool                panBlit = optionGetPanBlit () && !transformed &&
+				      paintsOutputAlone ();
+
+	/* Pan in whole pixels so the previous frame can be reused */
+	if (panBlit)
+	{
+	    panOffset (out, &panX, &panY);
+	    xtrans = -(float) panX * za.currentZoom / output->width ();
+	    ytrans = (float) panY * za.currentZoom / output->height ();
+	}
+
+	zTransform.scale (1.0f / za.currentZoom,
+		          1.0f / za.currentZoom,
+		          1.0f);
+	zTransform.translate (xtrans, ytrans, 0);
+
+	/* Only use the scene cache if nobody else transforms the screen */
+	if (optionGetCacheScene () && !transformed &&
+	    paintSceneCache (sa, transform, zTransform, output, mask))
+	{
+	    status = true;
+	}
+	/* The zoom is static and damage arrived mapped through the zoom, so
+	 * map it back and only repaint the windows below it. The core
+	 * refuses region painting of transformed outputs in glPaintOutput,
+	 * so go straight to glPaintTransformedOutput. */
+	else if ((mask & PAINT_SCREEN_REGION_MASK) && !transformed &&
+		 !isInMovement (out))
+	{
+	    mask |= PAINT_SCREEN_TRANSFORMED_MASK;
+
+	    gScreen->glPaintTransformedOutput (sa, zTransform,
+					       unzoomedRegion (out, region),
+					       output, mask);
+	    status = true;
+	}
+	else if (panBlit &&
+		 paintPanBlit (sa, transform, zTransform, output, mask,
+			       panX, panY))
+	{
+	    status = true;
+	    fullPaint = true;
+	}
+	else
+	{
+	    mask &= ~PAINT_SCREEN_REGION_MASK;
+	    mask |= PAINT_SCREEN_CLEAR_MASK;
+	    mask |= PAINT_SCREEN_TRANSFORMED_MASK;
+
+	    status = gScreen->glPaintOutput (sa, zTransform, region, output,
+					     mask);
+	    fullPaint = true;
+	}
+
+	/* Only worth keeping once the zoom level settled */
+	if (fullPaint && panBlit && za.currentZoom == za.newZoom)
+	    copyFrame (output, panX, panY);
+
+    }
+    else
+    {
+	status = gScreen->glPaintOutput (attrib, transform, region, output,
+									mask);
+    }
+
+    drawOverlay (transform, output, isActive (out), grabIndex);
+
+    return status;
+}
+
+/* Makes sure we're not attempting to translate too far.
+ * We are restricted to 0.5 to not go beyond the end
+ * of the screen/head.  */
+static inline void
+constrainZoomTranslate ()
+{
+    unsigned int out;
+    ZOOM_SCREEN (screen);
+
+    for (out = 0; out < zs->zooms.size (); out++)
+    {
+	if (zs->zooms.at (out).xTranslate > 0.5f)
+	    zs->zooms.at (out).xTranslate = 0.5f;
+	else if (zs->zooms.at (out).xTranslate < -0.5f)
+	    zs->zooms.at (out).xTranslate = -0.5f;
+
+	if (zs->zooms.at (out).yTranslate > 0.5f)
+	    zs->zooms.at (out).yTranslate = 0.5f;
+	else if (zs->zooms.at (out).yTranslate < -0.5f)
+	    zs->zooms.at (out).yTranslate = -0.5f;
+    }
+}
+
+/* Functions for adjusting the zoomed area.
+ * These are the core of the zoom plug-in; Anything wanting
+ * to adjust the zoomed area must use setCenter or setZoomArea
+ * and setScale or front ends to them.  */
+
+/* Sets the center of the zoom area to X,Y.
+ * We have to be able to warp the pointer here: If we are moved by
+ * anything except mouse movement, we have to sync the
+ * mouse pointer. This is to allow input, and is NOT necessary
+ * when input redirection is available to us or if we're cheating
+ * and using a scaled mouse cursor to imitate IR.
+ * The center is not the center of the screen. This is the target-center;
+ * that is, it's the point that's the same regardless of zoom level.
+ */
+void
+EZoomScreen::setCenter (int x, int y, bool instant)
+{
+    int         out = screen->outputDeviceForPoint (x, y);
+    CompOutput  *o = &screen->outputDevs ().at (out);
+
+    if (zooms.at (out).locked)
+	return;
+
+    zooms.at (out).xTranslate = (float)
+	((x - o->x1 ()) - o->width ()  / 2) / (o->width ());
+    zooms.at (out).yTranslate = (float)
+	((y - o->y1 ()) - o->height () / 2) / (o->height ());
+
+    if (instant)
+    {
+	zooms.at (out).realXTranslate = zooms.at (out).xTranslate;
+	zooms.at (out).realYTranslate = zooms.at (out).yTranslate;
+	zooms.at (out).yVelocity = 0.0f;
+	zooms.at (out).xVelocity = 0.0f;
+	zooms.at (out).updateActualTranslates ();
+    }
+
+    if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
+	restrainCursor (out);
+}
+
+/* Zooms the area described.
+ * The math could probably be cleaned up, but should be correct now. */
+void
+EZoomScreen::setZoomArea (int        x,
+	     		 int        y,
+	     		 int        width,
+	     		 int        height,
+	     		 bool       instant)
+{
+    CompWindow::Geometry outGeometry (x, y, width, height, 0);
+    int         out = screen->outputDeviceForGeometry (outGeometry);
+    CompOutput  *o = &screen->outputDevs ().at (out);
+
+    if (zooms.at (out).newZoom == 1.0f)
+	return;
+
+    if (zooms.at (out).locked)
+	return;
+    zooms.at (out).xTranslate =
+	 (float) -((o->width () / 2) - (x + (width / 2) - o->x1 ()))
+	/ (o->width ());
+    zooms.at (out).xTranslate /= (1.0f - zooms.at (out).newZoom);
+    zooms.at (out).yTranslate =
+	(float) -((o->height () / 2) - (y + (height / 2) - o->y1 ()))
+	/ (o->height ());
+    zooms.at (out).yTranslate /= (1.0f - zooms.at (out).newZoom);
+    constrainZoomTranslate ();
+
+    if (instant)
+    {
+	zooms.at (out).realXTranslate = zooms.at (out).xTranslate;
+	zooms.at (out).realYTranslate = zooms.at (out).yTranslate;
+	zooms.at (out).updateActualTranslates ();
+    }
+
+    if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
+	restrainCursor (out);
+}
+
+/* Moves the zoom area to the window specified */
+void
+EZoomScreen::areaToWindow (CompWindow *w)
+{
+    int left = w->serverX () - w->border ().left;
+    int width = w->width () + w->border ().left + w->border ().right;
+    int top = w->serverY () - w->border ().top;
+    int height = w->height ()  + w->border ().top + w->border ().bottom;
+
+    setZoomArea (left, top, width, height, false);
+}
+
+/* Pans the zoomed area vertically/horizontally by * value * zs->panFactor
+ * TODO: Fix output. */
+void
+EZoomScreen::panZoom (int xvalue, int yvalue)
+{
+    unsigned int out;
+
+    for (out = 0; out < zooms.size (); out++)
+    {
+	zooms.at (out).xTranslate +=
+	    optionGetPanFactor () * xvalue *
+	    zooms.at (out).currentZoom;
+	zooms.at (out).yTranslate +=
+	    optionGetPanFactor () * yvalue *
+	    zooms.at (out).currentZoom;
+    }
+
+    constrainZoomTranslate ();
+}
+
+/* Enables polling of mouse position, and refreshes currently
+ * stored values.
+ * XInput2 raw motion events are used instead of mousepoll if the server
+ * supports them and they are enabled, so the mouse is followed as soon
+ * as it moves and nothing wakes up while it doesn't.
+ */
+void
+EZoomScreen::enableMousePolling ()
+{
+    if (!xi2Supported ||
+	optionGetPointerSource () != EzoomOptions::PointerSourceRawMotionEvents ||
+	!selectRawMotion (true))
+	pollHandle.start ();
+    lastChange = currentMs ();
+    mouse = MousePoller::getCurrentPosition ();
+}
+
+void
+EZoomScreen::disableMousePolling ()
+{
+    if (pollHandle.active ())
+	pollHandle.stop ();
+
+    if (rawMotionSelected)
+	selectRawMotion (false);
+}
+
+bool
+EZoomScreen::mousePollingActive ()
+{
+    return pollHandle.active () || rawMotionSelected;
+}
+
+/* Raw motion events are only ever delivered to the root window, and
+ * regardless of which client has the pointer. Returns false if they
+ * could not be selected. */
+bool
+EZoomScreen::selectRawMotion (bool select)
+{
+    XIEventMask                 mask, *selected;
+    std::vector <unsigned char> bits (XIMaskLen (XI_RawMotion), 0);
+    int                         n;
+
+    /* Selections are per client, so keep whatever else compiz and the
+     * other plugins selected on the root window */
+    selected = XIGetSelectedEvents (screen->dpy (), screen->root (), &n);
+    for (int i = 0; selected && i < n; i++)
+    {
+	if (selected[i].deviceid != XIAllMasterDevices)
+	    continue;
+
+	if ((unsigned int) selected[i].mask_len > bits.size ())
+	    bits.resize (selected[i].mask_len, 0);
+	memcpy (&bits[0], selected[i].mask, selected[i].mask_len);
+    }
+    if (selected)
+	XFree (selected);
+
+    if (select)
+	XISetMask (&bits[0], XI_RawMotion);
+    else
+	XIClearMask (&bits[0], XI_RawMotion);
+
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = bits.size ();
+    mask.mask = &bits[0];
+
+    if (XISelectEvents (screen->dpy (), screen->root (), &mask, 1) != Success)
+	select = false;
+    rawMotionSelected = select;
+
+    if (!select)
+	motionTimer.stop ();
+
+    return select;
+}
+
+/* All raw motion events handled in one go have been seen, fetch where
+ * the pointer ended up. Raw events only carry device deltas. */
+bool
+EZoomScreen::rawMotionTimeout ()
+{
+    CompPoint p;
+
+    if (optionGetSamplePointerPerFrame () && grabbed)
+    {
+	schedulePointerSample ();
+	return false;
+    }
+
+    p = MousePoller::getCurrentPosition ();
+    if (p != mouse)
+	updateMouseInterval (p);
+
+    return false;
+}
+
+/* The pointer moved, but it is only sampled at the start of the next
+ * frame. Make sure there is one: damaging the cursor is enough, and
+ * preparePaint damages whatever else the new position needs.
+ */
+void
+EZoomScreen::schedulePointerSample ()
+{
+    if (pointerSamplePending)
+	return;
+
+    pointerSamplePending = true;
+    wakeUp ();
+
+    if (!lastCursorRect.isEmpty ())
+	damageZoomedRegion (CompRegion (lastCursorRect));
+    else
+	damageZoomedRegion (CompRegion (mouse.x (), mouse.y (), 1, 1));
+}
+
+/* Nothing moves until the next input, so stop doing work every frame.
+ * With raw motion events that leaves nothing running, all other timers
+ * of ours fire once. The mouse poller has no such wakeup to resume on,
+ * so it keeps running, unless the user asked for it to be stopped once
+ * the pointer has been idle for a while.
+ */
+void
+EZoomScreen::settle ()
+{
+    toggleAnimationFunctions (false);
+
+    /* Only the poller is left, raw motion events cost nothing while the
+     * pointer is idle */
+    if (optionGetIdleStopMousePoll () && pollHandle.active ())
+	idleTimer.start ();
+}
+
+/* Input arrived that might move the zoom area or the cursor. Resume
+ * animating and polling, and catch up on where the mouse went while
+ * it was not polled.
+ */
+void
+EZoomScreen::wakeUp ()
+{
+    if (!grabbed)
+	return;
+
+    if (settled)
+	toggleAnimationFunctions (true);
+
+    if (!mousePollingActive ())
+    {
+	enableMousePolling ();
+	updateMousePosition (mouse);
+    }
+}
+
+/* The pointer has been idle for a while */
+bool
+EZoomScreen::idleTimeout ()
+{
+    if (settled && pollHandle.active ())
+	pollHandle.stop ();
+
+    return false;
+}
+
+/* Connect to the accessibility bus the first time we zoom, rather than
+ * when the plugin loads. Called on every zoom step, only starting up
+ * does any work.  */
+void
+EZoomScreen::enableAccessibility ()
+{
+    a11yIdleTimer.stop ();
+
+    if (a11yListener)
+	return;
+
+    atspi_init ();
+
+    a11yListener = atspi_event_listener_new (&EZoomScreen::accessibilityEvent,
+					     this, NULL);
+    atspi_event_listener_register (a11yListener,
+				   "object:state-changed:focused", NULL);
+    atspi_event_listener_register (a11yListener,
+				   "object:bounds-changed", NULL);
+    a11yWindow = None;
+    a11yWindowPid = 0;
+    a11yTextWindow = false;
+
+    updateAccessibilitySubscriptions ();
+}
+
+/* Disconnect after sitting at 1.0x for a while, nothing to follow.
+ * Outstanding calls are cancelled first, nothing here waits for an
+ * application.  */
+bool
+EZoomScreen::disableAccessibility ()
+{
+    a11yIdleTimer.stop ();
+
+    if (!a11yListener)
+	return false;
+
+    extentQuery.cancel ();
+    a11yProcesses.cancel ();
+    publishAccessibilityStats (true);
+
+    a11yTimer.stop ();
+    a11yPendingFocus = AccessibleId ();
+    a11yPendingCaret = AccessibleId ();
+
+    atspi_event_listener_deregister (a11yListener,
+				     "object:state-changed:focused", NULL);
+    atspi_event_listener_deregister (a11yListener,
+				     "object:bounds-changed", NULL);
+    subscribeAccessibility (NULL);
+
+    if (a11yFocusSource)
+	g_object_unref (a11yFocusSource);
+    a11yFocusSource = NULL;
+
+    g_object_unref (a11yListener);
+    a11yListener = NULL;
+
+    return false;
+}
+
+/* Sets the zoom (or scale) level.
+ * Cleans up if we are suddenly zoomed out.
+ */
+void
+EZoomScreen::setScale (int out, float value)
+{
+    if (zooms.at (out).locked)
+	return;
+
+    if (value >= 1.0f)
+	value = 1.0f;
+    else
+    {
+	if (!mousePollingActive ())
+	    enableMousePolling ();
+	grabbed |= (1 << zooms.at (out).output);
+	cursorZoomActive (out);
+    }
+
+    if (value == 1.0f)
+    {
+	zooms.at (out).xTranslate = 0.0f;
+	zooms.at (out).yTranslate = 0.0f;
+	cursorZoomInactive ();
+    }
+
+    if (value < optionGetMinimumZoom ())
+	value = optionGetMinimumZoom ();
+
+    zooms.at (out).newZoom = value;
+    damageOutput (out);
+}
+
+/* Sets the zoom factor to the bigger of the two floats supplied.
+ * Convenience function for setting the scale factor for an area.
+ */
+static inline void
+setScaleBigger (int out, float x, float y)
+{
+    ZOOM_SCREEN (screen);
+    zs->setScale (out, x > y ? x : y);
+}
+
+/* Mouse code...
+ * This takes care of keeping the mouse in sync with the zoomed area and
+ * vice versa.
+ * See heading for description.
+ */
+
+/* Syncs the center, based on translations, back to the mouse.
+ * This should be called when doing non-IR zooming and moving the zoom
+ * area based on events other than mouse movement.
+ */
+void
+EZoomScreen::syncCenterToMouse ()
+{
+    int         x, y;
+    int         out;
+    CompOutput  *o;
+
+    out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
+    o = &screen->outputDevs ().at (out);
+
+    if (!isInMovement (out))
+	return;
+
+    x = (int) ((zooms.at (out).realXTranslate * o->width ()) +
+	       (o->width () / 2) + o->x1 ());
+    y = (int) ((zooms.at (out).realYTranslate * o->height ()) +
+	       (o->height () / 2) + o->y1 ());
+
+    if ((x != mouse.x () || y != mouse.y ())
+	&& grabbed && zooms.at (out).newZoom != 1.0f)
+    {
+	screen->warpPointer (x - pointerX , y - pointerY );
+	mouse.setX (x);
+	mouse.setY (y);
+    }
+}
+
+/* Convert the point X,Y to where it would be when zoomed.  */
+void
+EZoomScreen::convertToZoomed (int        out,
+			     int        x,
+			     int        y,
+			     int        *resultX,
+			     int        *resultY)
+{
+    CompOutput *o;
+
+    if (!outputIsZoomArea (out))
+    {
+	*resultX = x;
+	*resultY = y;
+    }
+
+    o = &screen->outputDevs ()[out];
+    ZoomArea    &za = zooms.at (out);
+
+    x -= o->x1 ();
+    y -= o->y1 ();
+    *resultX = x - (za.realXTranslate *
+		    (1.0f - za.currentZoom) * o->width ()) - o->width () / 2;
+    *resultX /= za.currentZoom;
+    *resultX += o->width () / 2;
+    *resultX += o->x1 ();
+    *resultY = y - (za.realYTranslate *
+		    (1.0f - za.currentZoom) * o->height ()) - o->height ()/ 2;
+    *resultY /= za.currentZoom;
+    *resultY += o->height ()/ 2;
+    *resultY += o->y1 ();
+}
+
+/* Convert the zoomed point X,Y back to where it is when not zoomed.
+ * This is the inverse of convertToZoomed.  */
+void
+EZoomScreen::convertFromZoomed (int        out,
+				int        x,
+				int        y,
+				int        *resultX,
+				int        *resultY)
+{
+    CompOutput *o;
+
+    if (!outputIsZoomArea (out))
+    {
+	*resultX = x;
+	*resultY = y;
+	return;
+    }
+
+    o = &screen->outputDevs ()[out];
+    ZoomArea    &za = zooms.at (out);
+
+    x -= o->x1 ();
+    y -= o->y1 ();
+    *resultX = (x - o->width () / 2) * za.currentZoom;
+    *resultX += za.realXTranslate * (1.0f - za.currentZoom) * o->width ();
+    *resultX += o->width () / 2;
+    *resultX += o->x1 ();
+    *resultY = (y - o->height () / 2) * za.currentZoom;
+    *resultY += za.realYTranslate * (1.0f - za.currentZoom) * o->height ();
+    *resultY += o->height () / 2;
+    *resultY += o->y1 ();
+}
+
+/* Map an unzoomed region on the output to where it ends up on screen
+ * when zoomed. Each rectangle grows by a pixel so rounding never loses
+ * any of it.  */
+CompRegion
+EZoomScreen::zoomedRegion (int out, const CompRegion &region)
+{
+    CompRegion result;
+    CompOutput *o = &screen->outputDevs ().at (out);
+    int        x1, y1, x2, y2;
+
+    foreach (const CompRect &r, region.rects ())
+    {
+	convertToZoomed (out, r.x1 (), r.y1 (), &x1, &y1);
+	convertToZoomed (out, r.x2 (), r.y2 (), &x2, &y2);
+	result += CompRect (x1 - 1, y1 - 1, x2 - x1 + 2, y2 - y1 + 2);
+    }
+
+    return result.intersected (CompRegion (*o));
+}
+
+/* Map a region on the zoomed output back to the unzoomed area shown
+ * there. See zoomedRegion.  */
+CompRegion
+EZoomScreen::unzoomedRegion (int out, const CompRegion &region)
+{
+    CompRegion result;
+    CompOutput *o = &screen->outputDevs ().at (out);
+    int        x1, y1, x2, y2;
+
+    foreach (const CompRect &r, region.rects ())
+    {
+	convertFromZoomed (out, r.x1 (), r.y1 (), &x1, &y1);
+	convertFromZoomed (out, r.x2 (), r.y2 (), &x2, &y2);
+	result += CompRect (x1 - 1, y1 - 1, x2 - x1 + 2, y2 - y1 + 2);
+    }
+
+    return result.intersected (CompRegion (*o));
+}
+
+/* Same but use targeted translation, not real */
+void
+EZoomScreen::convertToZoomedTarget (int	  out,
+			           int	  x,
+			           int	  y,
+			           int	  *resultX,
+			           int	  *resultY)
+{
+    CompOutput *o = &screen->outputDevs ().at (out);
+
+    if (!outputIsZoomArea (out))
+    {
+	*resultX = x;
+	*resultY = y;
+    }
+
+    ZoomArea    &za = zooms.at (out);
+
+    x -= o->x1 ();
+    y -= o->y1 ();
+    *resultX = x - (za.xTranslate *
+		    (1.0f - za.newZoom) * o->width ()) - o->width () / 2;
+    *resultX /= za.newZoom;
+    *resultX += o->width () / 2;
+    *resultX += o->x1 ();
+    *resultY = y - (za.yTranslate *
+		    (1.0f - za.newZoom) * o->height ()) - o->height ()/2;
+    *resultY /= za.newZoom;
+    *resultY += o->height () / 2;
+    *resultY += o->y1 ();
+}
+
+/* Make sure the given point + margin is visible;
+ * Translate to make it visible if necessary.
+ * Returns false if the point isn't on a actively zoomed head
+ * or the area is locked. */
+bool
+EZoomScreen::ensureVisibility (int x, int y, int margin)
+{
+    int         zoomX, zoomY;
+    int         out;
+    CompOutput  *o;
+
+    out = screen->outputDeviceForPoint (x, y);
+    if (!isActive (out))
+	return false;
+
+    o = &screen->outputDevs ().at (out);
+    convertToZoomedTarget (out, x, y, &zoomX, &zoomY);
+    ZoomArea &za = zooms.at (out);
+    if (za.locked)
+	return false;
+
+#define FACTOR (za.newZoom / (1.0f - za.newZoom))
+    if (zoomX + margin > o->x2 ())
+	za.xTranslate +=
+	    (FACTOR * (float) (zoomX + margin - o->x2 ())) /
+	    (float) o->width ();
+    else if (zoomX - margin < o->x1 ())
+	za.xTranslate +=
+	    (FACTOR * (float) (zoomX - margin - o->x1 ())) /
+	    (float) o->width ();
+
+    if (zoomY + margin > o->y2 ())
+	za.yTranslate +=
+	    (FACTOR * (float) (zoomY + margin - o->y2 ())) /
+	    (float) o->height ();
+    else if (zoomY - margin < o->y1 ())
+	za.yTranslate +=
+	    (FACTOR * (float) (zoomY - margin - o->y1 ())) /
+	    (float) o->height ();
+#undef FACTOR
+    constrainZoomTranslate ();
+    return true;
+}
+
+/* Attempt to ensure the visibility of an area defined by x1/y1 and x2/y2.
+ * See ensureVisibility () for details.
+ *
+ * This attempts to find the translations that leaves the biggest part of
+ * the area visible.
+ *
+ * gravity defines what part of the window that should get
+ * priority if it isn't possible to fit all of it.
+ */
+void
+EZoomScreen::ensureVisibilityArea (int         x1,
+				  int         y1,
+				  int         x2,
+				  int         y2,
+				  int         margin,
+				  ZoomGravity gravity)
+{
+    int        targetX, targetY, targetW, targetH;
+    int        out;
+    CompOutput *o;
+
+    out = screen->outputDeviceForPoint (x1 + (x2-x1/2), y1 + (y2-y1/2));
+    o = &screen->outputDevs ().at (out);
+
+#define WIDTHOK (float)(x2-x1) / (float)o->width () < zooms.at (out).newZoom
+#define HEIGHTOK (float)(y2-y1) / (float)o->height () < zooms.at (out).newZoom
+
+    if (WIDTHOK &&
+	HEIGHTOK) {
+	ensureVisibility (x1, y1, margin);
+	ensureVisibility (x2, y2, margin);
+	return;
+    }
+
+    switch (gravity)
+    {
+	case NORTHWEST:
+	    targetX = x1;
+	    targetY = y1;
+	    if (WIDTHOK)
+		targetW = x2 - x1;
+	    else
+		targetW = o->width () * zooms.at (out).newZoom;
+	    if (HEIGHTOK)
+		targetH = y2 - y1;
+	    else
+		targetH = o->height () * zooms.at (out).newZoom;
+	    break;
+	case NORTHEAST:
+	    targetY = y1;
+	    if (WIDTHOK)
+	    {
+		targetX = x1;
+		targetW = x2-x1;
+	    }
+	    else
+	    {
+		targetX = x2 - o->width () * zooms.at (out).newZoom;
+		targetW = o->width () * zooms.at (out).newZoom;
+	    }
+
+	    if (HEIGHTOK)
+		targetH = y2-y1;
+	    else
+		targetH = o->height () * zooms.at (out).newZoom;
+	    break;
+	case SOUTHWEST:
+	    targetX = x1;
+	    if (WIDTHOK)
+		targetW = x2-x1;
+	    else
+		targetW = o->width () * zooms.at (out).newZoom;
+	    if (HEIGHTOK)
+	    {
+		targetY = y1;
+		targetH = y2-y1;
+	    }
+	    else
+	    {
+		targetY = y2 - (o->width () * zooms.at (out).newZoom);
+		targetH = o->width () * zooms.at (out).newZoom;
+	    }
+	    break;
+	case SOUTHEAST:
+	    if (WIDTHOK)
+	    {
+		targetX = x1;
+		targetW = x2-x1;
+	    }
+	    else
+	    {
+		targetW = o->width () * zooms.at (out).newZoom;
+		targetX = x2 - targetW;
+	    }
+
+	    if (HEIGHTOK)
+	    {
+		targetY = y1;
+		targetH = y2 - y1;
+	    }
+	    else
+	    {
+		targetH = o->height () * zooms.at (out).newZoom;
+		targetY = y2 - targetH;
+	    }
+	    break;
+	case CENTER:
+	default:
+	    setCenter (x1 + (x2 - x1 / 2), y1 + (y2 - y1 / 2), false);
+	    return;
+	    break;
+    }
+
+    setZoomArea (targetX, targetY, targetW, targetH, false);
+    return ;
+}
+
+/* Ensures that the cursor is visible on the given head.
+ * Note that we check if currentZoom is 1.0f, because that often means that
+ * mouseX and mouseY is not up-to-date (since the polling timer just
+ * started).
+ */
+void
+EZoomScreen::restrainCursor (int out)
+{
+    int         x1, y1, x2, y2, margin;
+    int         diffX = 0, diffY = 0;
+    int         north, south, east, west;
+    float       z;
+    CompOutput  *o = &screen->outputDevs ().at (out);
+
+    z = zooms.at (out).newZoom;
+    margin = optionGetRestrainMargin ();
+    north = distanceToEdge (out, NORTH);
+    south = distanceToEdge (out, SOUTH);
+    east = distanceToEdge (out, EAST);
+    west = distanceToEdge (out, WEST);
+
+    if (zooms.at (out).currentZoom == 1.0f)
+    {
+	lastChange = currentMs ();
+	mouse = MousePoller::getCurrentPosition ();
+    }
+
+    convertToZoomedTarget (out, mouse.x () - cursor.hotX,
+			   mouse.y () - cursor.hotY, &x1, &y1);
+    convertToZoomedTarget
+	(out,
+	 mouse.x () - cursor.hotX + cursor.width,
+	 mouse.y () - cursor.hotY + cursor.height,
+	 &x2, &y2);
+
+    if ((x2 - x1 > o->x2 () - o->x1 ()) ||
+       (y2 - y1 > o->y2 () - o->y1 ()))
+	return;
+    if (x2 > o->x2 () - margin && east > 0)
+	diffX = x2 - o->x2 () + margin;
+    else if (x1 < o->x1 () + margin && west > 0)
+	diffX = x1 - o->x1 () - margin;
+
+    if (y2 > o->y2 () - margin && south > 0)
+	diffY = y2 - o->y2 () + margin;
+    else if (y1 < o->y1 () + margin && north > 0)
+	diffY = y1 - o->y1 () - margin;
+
+    if (abs(diffX)*z > 0  || abs(diffY)*z > 0)
+	screen->warpPointer ((int) (mouse.x () - pointerX) -
+						       (int) ((float)diffX * z),
+		     	     (int) (mouse.y () - pointerY) -
+						      (int) ((float)diffY * z));
+}
+
+/* Check if the cursor is still visible.
+ * We also make sure to activate/deactivate cursor scaling here
+ * so we turn on/off the pointer if it moves from one head to another.
+ * FIXME: Detect an actual output change instead of spamming.
+ * FIXME: The second ensureVisibility (sync with restrain).
+ */
+void
+EZoomScreen::cursorMoved ()
+{
+    int         out;
+
+    out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
+    if (isActive (out))
+    {
+	if (optionGetRestrainMouse ())
+	    restrainCursor (out);
+
+	if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
+	    submitTarget (SourceMouse,
+			  CompRect (mouse.x () - cursor.hotX,
+				    mouse.y () - cursor.hotY,
+				    cursor.width, cursor.height),
+			  None, false);
+
+	cursorZoomActive (out);
+    }
+    else
+    {
+	cursorZoomInactive ();
+    }
+}
+
+/* Update the mouse position.
+ * Based on the zoom engine in use, we will have to move the zoom area.
+ * This might have to be added to a timer.
+ */
+void
+EZoomScreen::updateMousePosition (const CompPoint &p)
+{
+    int out;
+    mouse.setX (p.x ());
+    mouse.setY (p.y ());
+    out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
+    lastChange = currentMs ();
+    if (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
+        !isInMovement (out))
+    {
+	setCenter (mouse.x (), mouse.y (), true);
+
+	/* The view follows the mouse, so all of it moved */
+	if (isActive (out))
+	    damageZoomedRegion (CompRegion (screen->outputDevs ().at (out)));
+    }
+    cursorMoved ();
+    damageCursor ();
+
+    if (settled && isInMovement (out))
+	wakeUp ();
+
+    if (idleTimer.active ())
+	idleTimer.start ();
+}
+
+/* Timeout handler to poll the mouse. Returns false (and thereby does not
+ * get re-added to the queue) when zoom is not active. */
+void
+EZoomScreen::updateMouseInterval (const CompPoint &p)
+{
+    /* Polled between frames, leave it to preparePaint */
+    if (grabbed && optionGetSamplePointerPerFrame ())
+    {
+	schedulePointerSample ();
+	return;
+    }
+
+    updateMousePosition (p);
+
+    if (!grabbed)
+    {
+	cursorMoved ();
+	disableMousePolling ();
+    }
+}
+
+/* Free a cursor */
+void
+EZoomScreen::freeCursor (CursorTexture * cursor)
+{
+    if (!cursor->isSet)
+	return;
+
+    cursor->isSet = false;
+
+    /* Theme cursors belong to themeCursors */
+    if (cursor->target == GL_TEXTURE_RECTANGLE_ARB)
+	glDeleteTextures (1, &cursor->texture);
+    cursor->texture = 0;
+}
+
+/* The factor the faux-cursor is scaled by on the given output */
+float
+EZoomScreen::cursorScaleFactor (int out)
+{
+    if (optionGetScaleMouseDynamic ())
+	return 1.0f / zooms.at (out).currentZoom;
+    else
+	return 1.0f / optionGetScaleMouseStatic ();
+}
+
+/* The on screen area covered by the faux-cursor, clipped to the output
+ * the mouse is on. Empty if no faux-cursor is painted.  */
+CompRect
+EZoomScreen::cursorRect ()
+{
+    int        out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
+    int        ax, ay, x1, y1, x2, y2;
+    float      scaleFactor;
+    CompOutput *o;
+
+    if (!cursor.isSet || hwCursorActive || !isActive (out))
+	return CompRect ();
+
+    o = &screen->outputDevs ().at (out);
+    scaleFactor = cursorScaleFactor (out);
+    convertToZoomed (out, mouse.x (), mouse.y (), &ax, &ay);
+
+    x1 = floor (ax - cursor.hotX * scaleFactor) - 1;
+    y1 = floor (ay - cursor.hotY * scaleFactor) - 1;
+    x2 = ceil (ax + (cursor.width - cursor.hotX) * scaleFactor) + 1;
+    y2 = ceil (ay + (cursor.height - cursor.hotY) * scaleFactor) + 1;
+
+    return CompRegion (x1, y1, x2 - x1, y2 - y1).intersected (*o).
+	boundingRect ();
+}
+
+/* Schedule a repaint of the faux-cursor. Only the first pointer update
+ * after a paint damages anything, preparePaint adds the final position
+ * for the frame so repeated polls coalesce.  */
+void
+EZoomScreen::damageCursor ()
+{
+    CompRect r;
+
+    if (cursorDamagePending)
+	return;
+
+    r = cursorRect ();
+    if (r == lastCursorRect)
+	return;
+
+    /* preparePaint has to finish this off */
+    if (settled)
+	wakeUp ();
+
+    cursorDamagePending = true;
+    damageZoomedRegion (CompRegion (lastCursorRect) + CompRegion (r));
+}
+
+/* Translate into place and draw the scaled cursor.
+ * Immediate mode fallback for drawOverlay.  */
+void
+EZoomScreen::drawCursor (CompOutput          *output,
+	    		const GLMatrix      &transform)
+{
+    int         out = output->id ();
+
+    if (cursor.isSet && !hwCursorActive)
+    {
+	GLMatrix      sTransform = transform;
+	float	      scaleFactor, tw, th;
+	int           ax, ay, x, y;
+
+	sTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
+	convertToZoomed (out, mouse.x (), mouse.y (), &ax, &ay);
+        glPushMatrix ();
+	glLoadMatrixf (sTransform.getMatrix ());
+	glTranslatef ((float) ax, (float) ay, 0.0f);
+	scaleFactor = cursorScaleFactor (out);
+	glScalef (scaleFactor,
+		  scaleFactor,
+		  1.0f);
+	x = -cursor.hotX;
+	y = -cursor.hotY;
+
+	/* Rectangle textures use texel coordinates, 2D ones from the
+	 * cursor theme are normalized and mipmapped */
+	if (cursor.target == GL_TEXTURE_2D)
+	    tw = th = 1.0f;
+	else
+	{
+	    tw = cursor.width;
+	    th = cursor.height;
+	}
+
+	glEnable (GL_BLEND);
+	glBindTexture (cursor.target, cursor.texture);
+	glEnable (cursor.target);
+
+	glBegin (GL_QUADS);
+	glTexCoord2f (0, 0);
+	glVertex2f (x, y);
+	glTexCoord2f (0, th);
+	glVertex2f (x, y + cursor.height);
+	glTexCoord2f (tw, th);
+	glVertex2f (x + cursor.width, y + cursor.height);
+	glTexCoord2f (tw, 0);
+	glVertex2f (x + cursor.width, y);
+	glEnd ();
+	glDisable (GL_BLEND);
+	glBindTexture (cursor.target, 0);
+	glDisable (cursor.target);
+	glPopMatrix ();
+    }
+}
+
+/* Converts XFixes cursor pixels to packed BGRA bytes. XFixes stores one
+ * ARGB pixel per unsigned long, so on 64 bit this narrows every pixel
+ * from 8 to 4 bytes.  */
+typedef void (*ConvertCursorProc) (const unsigned long *src,
+				   unsigned char       *dst,
+				   int                 n);
+
+static void
+convertCursorPixels (const unsigned long *src,
+		     unsigned char       *dst,
+		     int                 n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+	unsigned long pix = src[i];
+	dst[i * 4] = pix & 0xff;
+	dst[(i * 4) + 1] = (pix >> 8) & 0xff;
+	dst[(i * 4) + 2] = (pix >> 16) & 0xff;
+	dst[(i * 4) + 3] = (pix >> 24) & 0xff;
+    }
+}
+
+#if defined (__x86_64__) && defined (__GNUC__)
+
+/* On little endian x86_64 a pixel is the lower half of each 64 bit word,
+ * so it is just a matter of picking every other 32 bit lane. */
+static void
+convertCursorPixelsSSE2 (const unsigned long *src,
+			 unsigned char       *dst,
+			 int                 n)
+{
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+	__m128 a = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)
+						      (src + i)));
+	__m128 b = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)
+						      (src + i + 2)));
+
+	_mm_storeu_si128 ((__m128i *) (dst + i * 4),
+			  _mm_castps_si128 (_mm_shuffle_ps (a, b,
+					    _MM_SHUFFLE (2, 0, 2, 0))));
+    }
+
+    convertCursorPixels (src + i, dst + i * 4, n - i);
+}
+
+__attribute__ ((target ("avx2")))
+static void
+convertCursorPixelsAVX2 (const unsigned long *src,
+			 unsigned char       *dst,
+			 int                 n)
+{
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8)
+    {
+	__m256 a = _mm256_castsi256_ps (_mm256_loadu_si256 ((const __m256i *)
+							    (src + i)));
+	__m256 b = _mm256_castsi256_ps (_mm256_loadu_si256 ((const __m256i *)
+							    (src + i + 4)));
+	__m256i p;
+
+	/* Shuffles within 128 bit lanes, put the halves back in order */
+	p = _mm256_castps_si256 (_mm256_shuffle_ps (a, b,
+				 _MM_SHUFFLE (2, 0, 2, 0)));
+	p = _mm256_permute4x64_epi64 (p, _MM_SHUFFLE (3, 1, 2, 0));
+
+	_mm256_storeu_si256 ((__m256i *) (dst + i * 4), p);
+    }
+
+    convertCursorPixelsSSE2 (src + i, dst + i * 4, n - i);
+}
+
+#endif
+
+/* Pick the fastest conversion the CPU we run on supports */
+static ConvertCursorProc
+getConvertCursorProc ()
+{
+#if defined (__x86_64__) && defined (__GNUC__)
+    __builtin_cpu_init ();
+
+    if (__builtin_cpu_supports ("avx2"))
+	return convertCursorPixelsAVX2;
+
+    return convertCursorPixelsSSE2;
+#else
+    return convertCursorPixels;
+#endif
+}
+
+/* Scale a premultiplied ARGB image to dstWidth x dstHeight, bilinearly */
+static void
+scaleCursorImage (const uint32_t *src,
+		  int            width,
+		  int            height,
+		  uint32_t       *dst,
+		  int            dstWidth,
+		  int            dstHeight)
+{
+    float xScale = (float) width / dstWidth;
+    float yScale = (float) height / dstHeight;
+
+    for (int y = 0; y < dstHeight; y++)
+    {
+	float sy = MAX (0.0f, (y + 0.5f) * yScale - 0.5f);
+	int   y0 = MIN ((int) sy, height - 1);
+	int   y1 = MIN (y0 + 1, height - 1);
+	float fy = sy - y0;
+
+	for (int x = 0; x < dstWidth; x++)
+	{
+	    float    sx = MAX (0.0f, (x + 0.5f) * xScale - 0.5f);
+	    int      x0 = MIN ((int) sx, width - 1);
+	    int      x1 = MIN (x0 + 1, width - 1);
+	    float    fx = sx - x0;
+	    uint32_t p = 0;
+
+	    for (int shift = 0; shift < 32; shift += 8)
+	    {
+		float top = ((src[y0 * width + x0] >> shift) & 0xff) * (1 - fx) +
+			    ((src[y0 * width + x1] >> shift) & 0xff) * fx;
+		float bottom = ((src[y1 * width + x0] >> shift) & 0xff) *
+			       (1 - fx) +
+			       ((src[y1 * width + x1] >> shift) & 0xff) * fx;
+
+		p |= (uint32_t) (top * (1 - fy) + bottom * fy + 0.5f) << shift;
+	    }
+
+	    dst[y * dstWidth + x] = p;
+	}
+    }
+}
+
+/* Return a buffer of at least size bytes to write the next cursor image
+ * to. With a PBO this is the buffer mapped write-only, orphaned first so
+ * the driver hands out fresh storage instead of waiting for the previous
+ * upload to finish. Without one it is a staging buffer that only grows.
+ */
+unsigned char *
+EZoomScreen::mapCursorStaging (unsigned int size)
+{
+    unsigned char *pixels;
+
+    if (cursorPbo)
+    {
+	(*bindBuffer) (GL_PIXEL_UNPACK_BUFFER_ARB, cursorPbo);
+	(*bufferData) (GL_PIXEL_UNPACK_BUFFER_ARB, size, NULL,
+		       GL_STREAM_DRAW_ARB);
+	pixels = (unsigned char *) (*mapBuffer) (GL_PIXEL_UNPACK_BUFFER_ARB,
+						 GL_WRITE_ONLY_ARB);
+	if (pixels)
+	{
+	    cursorPboMapped = true;
+	    return pixels;
+	}
+
+	(*bindBuffer) (GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+    }
+
+    if (cursorStaging.size () < size)
+	cursorStaging.resize (size);
+
+    return &cursorStaging[0];
+}
+
+/* Upload what was written to the staging buffer into the cursor texture.
+ * If the texture already has storage of the right size it is updated in
+ * place rather than re-specified.  */
+void
+EZoomScreen::uploadCursorStaging (CursorTexture *cursor,
+				  bool          reuseStorage)
+{
+    const GLvoid *pixels = &cursorStaging[0];
+
+    if (cursorPboMapped)
+    {
+	cursorPboMapped = false;
+	(*unmapBuffer) (GL_PIXEL_UNPACK_BUFFER_ARB);
+	pixels = NULL; // offset into the bound PBO
+    }
+
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, cursor->texture);
+    if (reuseStorage)
+	glTexSubImage2D (GL_TEXTURE_RECTANGLE_ARB, 0, 0, 0, cursor->width,
+			 cursor->height, GL_BGRA, GL_UNSIGNED_BYTE, pixels);
+    else
+	glTexImage2D (GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, cursor->width,
+		      cursor->height, 0, GL_BGRA, GL_UNSIGNED_BYTE, pixels);
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, 0);
+
+    if (cursorPbo)
+	(*bindBuffer) (GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+}
+
+/* Create the cursor texture if it does not exist yet and enable
+ * rectangle textures for uploading to it. Returns true if the texture
+ * already had storage.  */
+bool
+EZoomScreen::prepareCursorTexture (CursorTexture *cursor)
+{
+    glEnable (GL_TEXTURE_RECTANGLE_ARB);
+
+    /* A texture object can not change its target */
+    if (cursor->isSet && cursor->target != GL_TEXTURE_RECTANGLE_ARB)
+	freeCursor (cursor);
+
+    if (cursor->isSet)
+	return true;
+
+    cursor->isSet = true;
+    cursor->screen = screen;
+    cursor->target = GL_TEXTURE_RECTANGLE_ARB;
+    glGenTextures (1, &cursor->texture);
+    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, cursor->texture);
+
+    glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+		     GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
+		     GL_TEXTURE_WRAP_T, GL_CLAMP);
+
+    return false;
+}
+
+/* Name of a cursor atom, cached as we need it on every new cursor */
+const CompString &
+EZoomScreen::cursorAtomName (Atom name)
+{
+    std::map <Atom, CompString>::iterator it = cursorAtomNames.find (name);
+
+    if (it == cursorAtomNames.end ())
+    {
+	char *atomName = XGetAtomName (screen->dpy (), name);
+
+	it = cursorAtomNames.insert (std::make_pair (name, CompString ())).first;
+	if (atomName)
+	{
+	    it->second = atomName;
+	    XFree (atomName);
+	}
+    }
+
+    return it->second;
+}
+
+/* Show the named cursor from the cursor theme, loaded at every power of
+ * two scale up to the largest one we can zoom the cursor by and stored
+ * as the mipmap levels of a 2D texture. Level 0 is the largest, the last
+ * level is the cursor at its normal size. Drawing then samples the level
+ * nearest the zoom, so a zoomed cursor stays sharp and changing the zoom
+ * never uploads anything.
+ *
+ * Only used for cursors that look like the theme says they should at
+ * the current size. Animated cursors are left to XFixes, which hands out
+ * every frame. Returns false until the theme loader has read it, the
+ * XFixes image is shown in the meantime.  */
+bool
+EZoomScreen::loadThemeCursor (CursorTexture *cursor,
+			      Atom          name,
+			      int           width,
+			      int           height)
+{
+    const char *theme = XcursorGetTheme (screen->dpy ());
+    float      maxScale;
+    int        levels;
+
+    if (!optionGetThemeCursor () || name == None ||
+	!GL::textureNonPowerOfTwo)
+	return false;
+
+    if (optionGetScaleMouseDynamic ())
+	maxScale = 1.0f / optionGetMinimumZoom ();
+    else
+	maxScale = 1.0f / optionGetScaleMouseStatic ();
+
+    for (levels = 0; levels < 3 && (1 << levels) < maxScale; levels++);
+
+    /* The theme or its size can change at any time, the cursor then
+     * comes from a different set of images */
+    ThemeCursorKey key (name, theme ? theme : "",
+			XcursorGetDefaultSize (screen->dpy ()),
+			width, height, levels);
+    std::map <ThemeCursorKey, ThemeCursor>::iterator it =
+	themeCursors.find (key);
+
+    if (it == themeCursors.end ())
+    {
+	requestThemeCursor (key);
+	return false;
+    }
+
+    if (!it->second.texture)
+	return false;
+
+    freeCursor (cursor);
+
+    cursor->isSet = true;
+    cursor->screen = screen;
+    cursor->target = GL_TEXTURE_2D;
+    cursor->texture = it->second.texture;
+    cursor->width = width;
+    cursor->height = height;
+    cursor->hotX = it->second.hotX;
+    cursor->hotY = it->second.hotY;
+
+    return true;
+}
+
+/* Queue a theme cursor for the loader. Its entry is made right away, so
+ * a cursor the theme does not have is only ever asked for once.  */
+void
+EZoomScreen::requestThemeCursor (const ThemeCursorKey &key)
+{
+    ThemeLoader::Job job;
+
+    themeCursors[key] = ThemeCursor ();
+
+    const CompString &cursorName = cursorAtomName (key.name);
+
+    if (cursorName.empty () || key.theme.empty () || key.size <= 0)
+	return;
+
+    if (themeLoader.fd () < 0)
+    {
+	if (!themeLoader.start ())
+	    return;
+
+	themeWatch = screen->addWatchFd (themeLoader.fd (), POLLIN,
+					 boost::bind (
+					     &EZoomScreen::handleThemeCursors,
+					     this));
+    }
+
+    job.name = key.name;
+    job.cursorName = cursorName;
+    job.theme = key.theme;
+    job.size = key.size;
+    job.width = key.width;
+    job.height = key.height;
+    job.levels = key.levels;
+
+    themeLoader.load (job);
+}
+
+/* Upload what the theme loader read, and switch to it if that cursor is
+ * on screen.  */
+void
+EZoomScreen::handleThemeCursors ()
+{
+    ThemeLoader::Job job;
+
+    themeLoader.drain ();
+
+    while (themeLoader.pop (job))
+    {
+	ThemeCursorKey key (job.name, job.theme, job.size, job.width,
+			    job.height, job.levels);
+	ThemeCursor    &tc = themeCursors[key];
+
+	if (!job.found || tc.texture)
+	    continue;
+
+	tc.hotX = job.hotX;
+	tc.hotY = job.hotY;
+
+	glEnable (GL_TEXTURE_2D);
+	glGenTextures (1, &tc.texture);
+	glBindTexture (GL_TEXTURE_2D, tc.texture);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+			 GL_LINEAR_MIPMAP_NEAREST);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, job.levels);
+
+	for (int level = 0; level <= job.levels; level++)
+	{
+	    int scale = 1 << (job.levels - level);
+
+	    glTexImage2D (GL_TEXTURE_2D, level, GL_RGBA,
+			  job.width * scale, job.height * scale, 0, GL_BGRA,
+			  GL_UNSIGNED_INT_8_8_8_8_REV, &job.images[level][0]);
+	}
+
+	glBindTexture (GL_TEXTURE_2D, 0);
+	glDisable (GL_TEXTURE_2D);
+
+	if (cursor.isSet && cursor.target != GL_TEXTURE_2D &&
+	    cursorName == job.name &&
+	    cursor.width == job.width && cursor.height == job.height)
+	{
+	    CompRegion    damage (lastCursorRect);
+	    unsigned long serial = cursor.serial;
+
+	    if (loadThemeCursor (&cursor, job.name, job.width, job.height))
+	    {
+		cursor.serial = serial;
+		lastCursorRect = cursorRect ();
+		damage += lastCursorRect;
+		damageZoomedRegion (damage);
+	    }
+	}
+    }
+}
+
+/* Theme cursor textures are shared by every CursorTexture showing them,
+ * freeCursor leaves them alone.  */
+void
+EZoomScreen::freeThemeCursors ()
+{
+    std::map <ThemeCursorKey, ThemeCursor>::iterator it;
+
+    for (it = themeCursors.begin (); it != themeCursors.end (); ++it)
+    {
+	if (it->second.texture)
+	    glDeleteTextures (1, &it->second.texture);
+    }
+
+    themeCursors.clear ();
+}
+
+/* Create (if necessary) a texture to store the cursor,
+ * fetch the cursor with XFixes. Store it.
+ * This waits for the server, it is only used when there is no cursor
+ * to show yet. Cursor changes go through requestCursorImage.  */
+void
+EZoomScreen::updateCursor (CursorTexture * cursor)
+{
+    unsigned char *pixels;
+    bool          reuseStorage;
+    int           width = cursor->width;
+    int           height = cursor->height;
+    Display       *dpy = screen->dpy ();
+
+    static ConvertCursorProc convertCursor = getConvertCursorProc ();
+
+    XFixesCursorImage *ci = XFixesGetCursorImage (dpy);
+
+    if (ci && loadThemeCursor (cursor, ci->atom, ci->width, ci->height))
+    {
+	cursor->serial = ci->cursor_serial;
+	cursorName = ci->atom;
+	cursorSerial = ci->cursor_serial;
+	XFree (ci);
+	return;
+    }
+
+    reuseStorage = prepareCursorTexture (cursor);
+
+    if (ci)
+    {
+	cursor->width = ci->width;
+	cursor->height = ci->height;
+	cursor->hotX = ci->xhot;
+	cursor->hotY = ci->yhot;
+	cursor->serial = ci->cursor_serial;
+	cursorName = ci->atom;
+	cursorSerial = ci->cursor_serial;
+	pixels = mapCursorStaging (ci->width * ci->height * 4);
+
+	convertCursor (ci->pixels, pixels, ci->width * ci->height);
+
+	XFree (ci);
+    }
+    else
+    {
+	/* Fallback R: 255 G: 255 B: 255 A: 255
+	 * FIXME: Draw a cairo mouse cursor */
+
+	cursor->width = 1;
+	cursor->height = 1;
+	cursor->hotX = 0;
+	cursor->hotY = 0;
+	cursor->serial = 0;
+	pixels = mapCursorStaging (cursor->width * cursor->height * 4);
+
+	unsigned long pix = 0x00ffffff;
+	convertCursor (&pix, pixels, 1);
+
+	compLogMessage ("ezoom", CompLogLevelWarn, "unable to get system cursor image!");
+    }
+
+    reuseStorage = reuseStorage &&
+		   width == cursor->width && height == cursor->height;
+
+    uploadCursorStaging (cursor, reuseStorage);
+    glDisable (GL_TEXTURE_RECTANGLE_ARB);
+}
+
+/* Store a cursor image received from xcb in the given texture.
+ * Unlike XFixesGetCursorImage, xcb hands out 32 bit pixels, so there is
+ * nothing to narrow.  */
+void
+EZoomScreen::setCursorImage (CursorTexture    *cursor,
+			     CursorImageReply *ci)
+{
+    unsigned char *pixels;
+    uint32_t      *src;
+    bool          reuseStorage;
+    int           n = ci->width * ci->height;
+
+    src = xcb_xfixes_get_cursor_image_and_name_cursor_image (ci);
+
+    if (loadThemeCursor (cursor, ci->cursor_atom, ci->width, ci->height))
+    {
+	cursor->serial = ci->cursor_serial;
+	return;
+    }
+
+    reuseStorage = prepareCursorTexture (cursor) &&
+		   cursor->width == ci->width &&
+		   cursor->height == ci->height;
+
+    cursor->width = ci->width;
+    cursor->height = ci->height;
+    cursor->hotX = ci->xhot;
+    cursor->hotY = ci->yhot;
+    cursor->serial = ci->cursor_serial;
+    pixels = mapCursorStaging (n * 4);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy (pixels, src, n * 4);
+#else
+    for (int i = 0; i < n; i++)
+    {
+	pixels[i * 4] = src[i] & 0xff;
+	pixels[(i * 4) + 1] = (src[i] >> 8) & 0xff;
+	pixels[(i * 4) + 2] = (src[i] >> 16) & 0xff;
+	pixels[(i * 4) + 3] = (src[i] >> 24) & 0xff;
+    }
+#endif
+
+    uploadCursorStaging (cursor, reuseStorage);
+    glDisable (GL_TEXTURE_RECTANGLE_ARB);
+}
+
+/* Ask the server for the current cursor image without waiting for it.
+ * The reply is picked up by collectCursorImage, until then the previous
+ * cursor keeps being drawn. Only the newest request matters, an older
+ * one still in flight is dropped.  */
+void
+EZoomScreen::requestCursorImage ()
+{
+    xcb_connection_t *c = XGetXCBConnection (screen->dpy ());
+
+    if (cursorRequestPending)
+	xcb_discard_reply (c, cursorCookie.sequence);
+
+    cursorCookie = xcb_xfixes_get_cursor_image_and_name (c);
+    cursorRequestPending = true;
+    xcb_flush (c);
+}
+
+void
+EZoomScreen::cancelCursorRequest ()
+{
+    if (!cursorRequestPending)
+	return;
+
+    xcb_discard_reply (XGetXCBConnection (screen->dpy ()),
+		       cursorCookie.sequence);
+    cursorRequestPending = false;
+}
+
+/* Check if the cursor image we asked for has arrived. Called when the X
+ * connection becomes readable, and after events and before painting in
+ * case Xlib already read the reply off the connection.  */
+void
+EZoomScreen::collectCursorImage ()
+{
+    xcb_connection_t    *c = XGetXCBConnection (screen->dpy ());
+    xcb_generic_error_t *error = NULL;
+    void                *reply = NULL;
+
+    if (!cursorRequestPending)
+	return;
+
+    if (!xcb_poll_for_reply (c, cursorCookie.sequence, &reply, &error))
+	return;
+
+    cursorRequestPending = false;
+
+    if (error)
+    {
+	free (error);
+	return;
+    }
+
+    CursorImageReply *ci = (CursorImageReply *) reply;
+    bool             changed = false;
+
+    /* One of our scaled cursors, nothing to paint or learn */
+    if (ci && hwVerifySerial == ci->cursor_serial)
+    {
+	hwVerifySerial = 0;
+	if (verifyHardwareCursor (ci))
+	{
+	    free (reply);
+	    return;
+	}
+
+	/* A cursor of the same name that is not ours */
+	changed = true;
+    }
+
+    /* Only learn the image of the very cursor we asked about, the cursor
+     * may have changed since */
+    if (ci && hwLearnName != None)
+    {
+	if (ci->cursor_atom == hwLearnName &&
+	    ci->cursor_serial == hwLearnSerial)
+	{
+	    learnHardwareCursor (ci);
+	    changed = true;
+	}
+	hwLearnName = None;
+    }
+
+    if (ci && cursor.isSet && cursor.serial != ci->cursor_serial)
+    {
+	CompRegion damage (lastCursorRect);
+
+	if (cursor.serial && optionGetCursorCacheSize ())
+	{
+	    cursorCache.push_front (cursor);
+	    cursor.isSet = false;
+
+	    /* Recycle the texture that would drop out of the cache anyway,
+	     * cursors mostly share a size so its storage can be reused */
+	    if (cursorCache.size () >
+		(unsigned int) optionGetCursorCacheSize ())
+	    {
+		cursor = cursorCache.back ();
+		cursorCache.pop_back ();
+	    }
+	}
+
+	setCursorImage (&cursor, ci);
+	trimCursorCache (optionGetCursorCacheSize ());
+
+	lastCursorRect = cursorRect ();
+	damage += lastCursorRect;
+	damageZoomedRegion (damage);
+    }
+
+    free (reply);
+
+    if (changed)
+	updateHardwareCursor (true);
+}
+
+/* Make the cursor with the given XFixes serial the current one.
+ * The previous cursor is kept in the cache, so switching back to a shape
+ * seen recently is just a texture switch: no round trip to the server,
+ * no conversion and no upload. Other shapes are fetched asynchronously.
+ */
+void
+EZoomScreen::switchCursor (unsigned long serial)
+{
+    std::list <CursorTexture>::iterator it;
+
+    if (cursor.isSet && cursor.serial == serial)
+    {
+	cancelCursorRequest ();
+	return;
+    }
+
+    for (it = cursorCache.begin (); it != cursorCache.end (); ++it)
+	if (it->serial == serial)
+	    break;
+
+    if (it == cursorCache.end ())
+    {
+	requestCursorImage ();
+	return;
+    }
+
+    cancelCursorRequest ();
+
+    if (cursor.isSet && cursor.serial && optionGetCursorCacheSize ())
+    {
+	cursorCache.push_front (cursor);
+	cursor.isSet = false;
+    }
+    else
+	freeCursor (&cursor);
+
+    cursor = *it;
+    cursorCache.erase (it);
+
+    trimCursorCache (optionGetCursorCacheSize ());
+}
+
+/* Drop the least recently used cursors until at most size are left */
+void
+EZoomScreen::trimCursorCache (unsigned int size)
+{
+    while (cursorCache.size () > size)
+    {
+	freeCursor (&cursorCache.back ());
+	cursorCache.pop_back ();
+    }
+}
+
+/* The real cursor can stand in for the faux-cursor only where the pointer
+ * is on top of what it points at, which is when the zoom follows it.  */
+bool
+EZoomScreen::hardwareCursorUsable (int out)
+{
+    return optionGetHardwareCursor () && optionGetScaleMouse () &&
+	   fixesSupported && hwCursorMaxSize > 0 &&
+	   optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
+	   !zooms.at (out).locked;
+}
+
+bool
+EZoomScreen::shouldHideCursor (int out)
+{
+    return canHideCursor && !hwCursorActive &&
+	   (optionGetHideOriginalMouse () || zooms.at (out).locked);
+}
+
+/* Remember the image of a named cursor, so scaled copies of it can be
+ * made without asking the server again.  */
+void
+EZoomScreen::learnHardwareCursor (CursorImageReply *ci)
+{
+    uint32_t *src = xcb_xfixes_get_cursor_image_and_name_cursor_image (ci);
+    Atom     name = ci->cursor_atom;
+
+    if (hwCursors.find (name) != hwCursors.end ())
+	return;
+
+    const CompString &atomName = cursorAtomName (name);
+
+    if (atomName.empty ())
+	return;
+
+    HardwareCursor &hc = hwCursors[name];
+
+    hc.name = atomName;
+
+    hc.width = ci->width;
+    hc.height = ci->height;
+    hc.hotX = ci->xhot;
+    hc.hotY = ci->yhot;
+    hc.pixels.assign (src, src + ci->width * ci->height);
+}
+
+/* Create a cursor from the image of hc scaled by scale, carrying the
+ * same name so it can be replaced again later.  */
+Cursor
+EZoomScreen::makeHardwareCursor (HardwareCursor &hc,
+				 float          scale)
+{
+    XcursorImage *image;
+    Cursor       c;
+    int          width = MAX (1, (int) ceil (hc.width * scale));
+    int          height = MAX (1, (int) ceil (hc.height * scale));
+
+    image = XcursorImageCreate (width, height);
+    if (!image)
+	return None;
+
+    scaleCursorImage (&hc.pixels[0], hc.width, hc.height,
+		      image->pixels, width, height);
+    image->xhot = MIN ((int) (hc.hotX * scale), width - 1);
+    image->yhot = MIN ((int) (hc.hotY * scale), height - 1);
+
+    c = XcursorImageLoadCursor (screen->dpy (), image);
+    XcursorImageDestroy (image);
+
+    if (c)
+	XFixesSetCursorName (screen->dpy (), c, hc.name.c_str ());
+
+    return c;
+}
+
+/* Replace every cursor named like hc with a copy scaled to the given
+ * size bucket. Copies are cached per bucket, so zooming back and forth
+ * only swaps cursors around on the server.
+ * This changes the cursors of every client, and the server keeps the
+ * change after we are gone. Every way out of zooming puts the originals
+ * back, but if the compositor crashes the scaled cursors stay until the
+ * applications set their cursors again.  */
+bool
+EZoomScreen::installHardwareCursor (Atom           name,
+				    HardwareCursor &hc,
+				    int            bucket)
+{
+    if (hc.pixels.empty ())
+	return false;
+
+    if (!hc.original)
+	hc.original = makeHardwareCursor (hc, 1.0f);
+
+    Cursor &c = hc.scaled[bucket];
+
+    if (!c)
+	c = makeHardwareCursor (hc, bucket / 4.0f);
+
+    if (!hc.original || !c)
+	return false;
+
+    XFixesChangeCursorByName (screen->dpy (), c, hc.name.c_str ());
+    hc.installed = bucket;
+
+    return true;
+}
+
+/* Check whether a cursor serial is known to be one of our scaled
+ * cursors, see verifyHardwareCursor.  */
+bool
+EZoomScreen::ownHardwareCursor (unsigned long serial)
+{
+    std::map <Atom, HardwareCursor>::iterator it;
+
+    it = hwCursors.find (cursorName);
+    if (it == hwCursors.end ())
+	return false;
+
+    return it->second.serials.find (serial) != it->second.serials.end ();
+}
+
+/* We do not know the serials of our scaled cursors until the server
+ * shows them. A new serial with the name of an installed cursor is only
+ * ours if its image has the size and hotspot of the scaled copy.  */
+bool
+EZoomScreen::verifyHardwareCursor (CursorImageReply *ci)
+{
+    std::map <Atom, HardwareCursor>::iterator it;
+    float scale;
+
+    it = hwCursors.find (ci->cursor_atom);
+    if (it == hwCursors.end () || !it->second.installed)
+	return false;
+
+    HardwareCursor &hc = it->second;
+
+    scale = hc.installed / 4.0f;
+    if ((int) ci->width != MAX (1, (int) ceil (hc.width * scale)) ||
+	(int) ci->height != MAX (1, (int) ceil (hc.height * scale)) ||
+	(int) ci->xhot != MIN ((int) (hc.hotX * scale), ci->width - 1) ||
+	(int) ci->yhot != MIN ((int) (hc.hotY * scale), ci->height - 1))
+	return false;
+
+    hc.serials.insert (ci->cursor_serial);
+
+    return true;
+}
+
+/* Switch between the hardware cursor and the faux-cursor as needed, and
+ * keep the hardware cursor at the size bucket nearest the zoom. changed
+ * is set when the server just showed a cursor that is not ours.  */
+void
+EZoomScreen::updateHardwareCursor (bool changed)
+{
+    int out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
+    std::map <Atom, HardwareCursor>::iterator it = hwCursors.end ();
+
+    if (cursor.isSet && cursorName != None && hardwareCursorUsable (out))
+    {
+	it = hwCursors.find (cursorName);
+
+	/* Scaled once we have its image, paint it until then */
+	if (it == hwCursors.end () && hwLearnName != cursorName)
+	{
+	    hwLearnName = cursorName;
+	    hwLearnSerial = cursorSerial;
+	    if (!cursorRequestPending)
+		requestCursorImage ();
+	}
+    }
+
+    if (it != hwCursors.end ())
+    {
+	HardwareCursor &hc = it->second;
+	int            bucket, maxBucket;
+
+	bucket = MAX (4, (int) (cursorScaleFactor (out) * 4.0f + 0.5f));
+	maxBucket = (hwCursorMaxSize * 4) / MAX (1, MAX (hc.width, hc.height));
+	bucket = MAX (4, MIN (bucket, maxBucket));
+
+	if ((!changed && hwCursorActive && hc.installed == bucket) ||
+	    installHardwareCursor (it->first, hc, bucket))
+	{
+	    if (!hwCursorActive)
+	    {
+		hwCursorActive = true;
+		if (cursorHidden)
+		{
+		    cursorHidden = false;
+		    XFixesShowCursor (screen->dpy (), screen->root ());
+		}
+		damageZoomedRegion (CompRegion (lastCursorRect));
+		lastCursorRect = CompRect ();
+	    }
+	    return;
+	}
+    }
+
+    if (!hwCursorActive)
+	return;
+
+    /* Fall back to painting the cursor */
+    restoreHardwareCursors ();
+    hwCursorActive = false;
+    if (!cursorHidden && shouldHideCursor (out))
+    {
+	cursorHidden = true;
+	XFixesHideCursor (screen->dpy (), screen->root ());
+    }
+    damageCursor ();
+}
+
+/* Put the original cursors back */
+void
+EZoomScreen::restoreHardwareCursors ()
+{
+    std::map <Atom, HardwareCursor>::iterator it;
+
+    for (it = hwCursors.begin (); it != hwCursors.end (); ++it)
+    {
+	HardwareCursor &hc = it->second;
+
+	if (!hc.installed)
+	    continue;
+
+	XFixesChangeCursorByName (screen->dpy (), hc.original,
+				  hc.name.c_str ());
+	hc.installed = 0;
+    }
+
+    hwVerifySerial = 0;
+}
+
+void
+EZoomScreen::freeHardwareCursors ()
+{
+    std::map <Atom, HardwareCursor>::iterator it;
+    std::map <int, Cursor>::iterator          c;
+
+    restoreHardwareCursors ();
+
+    for (it = hwCursors.begin (); it != hwCursors.end (); ++it)
+    {
+	HardwareCursor &hc = it->second;
+
+	for (c = hc.scaled.begin (); c != hc.scaled.end (); ++c)
+	    if (c->second)
+		XFreeCursor (screen->dpy (), c->second);
+
+	if (hc.original)
+	    XFreeCursor (screen->dpy (), hc.original);
+    }
+
+    hwCursors.clear ();
+}
+
+/* We are no longer zooming the cursor, so display it.  */
+void
+EZoomScreen::cursorZoomInactive ()
+{
+    if (!fixesSupported)
+	return;
+
+    if (cursorInfoSelected)
+    {
+	cursorInfoSelected = false;
+	XFixesSelectCursorInput (screen->dpy (), screen->root (), 0);
+    }
+
+    cancelCursorRequest ();
+
+    if (hwCursorActive)
+    {
+	restoreHardwareCursors ();
+	hwCursorActive = false;
+    }
+    hwLearnName = None;
+    hwVerifySerial = 0;
+
+    if (cursor.isSet)
+    {
+	freeCursor (&cursor);
+    }
+
+    if (cursorHidden)
+    {
+	cursorHidden = false;
+	XFixesShowCursor (screen->dpy (), screen->root ());
+    }
+}
+
+/* Cursor zoom is active: We need to hide the original,
+ * register for Cursor notifies and display the new one.
+ * This can be called multiple times, not just on initial
+ * activation.
+ */
+void
+EZoomScreen::cursorZoomActive (int out)
+{
+    if (!fixesSupported)
+	return;
+
+    /* Force cursor hiding and mouse panning if this output is locked
+     * and cursor hiding is not enabled and we are syncing the mouse
+     */
+
+    if (!optionGetScaleMouse () &&
+        (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
+	 optionGetHideOriginalMouse () &&
+	 !zooms.at (out).locked))
+	return;
+
+    if (!cursorInfoSelected)
+    {
+	cursorInfoSelected = true;
+        XFixesSelectCursorInput (screen->dpy (), screen->root (),
+				 XFixesDisplayCursorNotifyMask);
+	updateCursor (&cursor);
+    }
+
+    updateHardwareCursor (false);
+
+    if (!cursorHidden && shouldHideCursor (out))
+    {
+	cursorHidden = true;
+	XFixesHideCursor (screen->dpy (), screen->root ());
+    }
+}
+
+/* Set the zoom area
+ * This is an interface for scripting.
+ * int32:x1: left x coordinate
+ * int32:y1: top y coordinate
+ * int32:x2: right x
+ * int32:y2: bottom y
+ * x2 and y2 can be omitted to assume x1==x2+1 y1==y2+1
+ * boolean:scale: True if we should modify the zoom level, false to just
+ *                adjust the movement/translation.
+ * boolean:restrain: True to warp the pointer so it's visible.
+ */
+bool
+EZoomScreen::setZoomAreaAction (CompAction         *action,
+			       CompAction::State  state,
+			       CompOption::Vector options)
+{
+    int        x1, y1, x2, y2, out;
+    bool       scale, restrain;
+    CompOutput *o;
+
+    x1 = CompOption::getIntOptionNamed (options, "x1", -1);
+    y1 = CompOption::getIntOptionNamed (options, "y1", -1);
+    x2 = CompOption::getIntOptionNamed (options, "x2", -1);
+    y2 = CompOption::getIntOptionNamed (options, "y2", -1);
+    scale = CompOption::getBoolOptionNamed (options, "scale", false);
+    restrain = CompOption::getBoolOptionNamed (options, "restrain", false);
+
+    if (x1 < 0 || y1 < 0)
+        return false;
+
+    if (x2 < 0)
+        x2 = x1 + 1;
+
+    if (y2 < 0)
+        y2 = y1 + 1;
+
+    out = screen->outputDeviceForPoint (x1, y1);
+#define WIDTH (x2 - x1)
+#define HEIGHT (y2 - y1)
+    setZoomArea (x1, y1, WIDTH, HEIGHT, false);
+    o = &screen->outputDevs (). at(out);
+    if (scale && WIDTH && HEIGHT)
+        setScaleBigger (out, (float) WIDTH / o->width (),
+		        (float) HEIGHT / o->height ());
+#undef WIDTH
+#undef HEIGHT
+	if (restrain)
+	    restrainCursor (out);
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+/* Ensure visibility of an area defined by x1->x2/y1->y2
+ * int:x1: left X coordinate
+ * int:x2: right X Coordinate
+ * int:y1: top Y coordinate
+ * int:y2: bottom Y coordinate
+ * bool:scale: zoom out if necessary to ensure visibility
+ * bool:restrain: Restrain the mouse cursor
+ * int:margin: The margin to use (default: 0)
+ * if x2/y2 is omitted, it is ignored.
+ */
+bool
+EZoomScreen::ensureVisibilityAction (CompAction         *action,
+			            CompAction::State  state,
+			            CompOption::Vector options)
+{
+    int        x1, y1, x2, y2, margin, out;
+    bool       scale, restrain;
+    CompOutput *o;
+
+    x1 = CompOption::getIntOptionNamed (options, "x1", -1);
+    y1 = CompOption::getIntOptionNamed (options, "y1", -1);
+    x2 = CompOption::getIntOptionNamed (options, "x2", -1);
+    y2 = CompOption::getIntOptionNamed (options, "y2", -1);
+    margin = CompOption::getBoolOptionNamed (options, "margin", 0);
+    scale = CompOption::getBoolOptionNamed (options, "scale", false);
+    restrain = CompOption::getBoolOptionNamed (options, "restrain", false);
+    if (x1 < 0 || y1 < 0)
+        return false;
+    if (x2 < 0)
+        y2 = y1 + 1;
+    out = screen->outputDeviceForPoint (x1, y1);
+    ensureVisibility (x1, y1, margin);
+    if (x2 >= 0 && y2 >= 0)
+        ensureVisibility (x2, y2, margin);
+    o = &screen->outputDevs (). at(out);
+#define WIDTH (x2 - x1)
+#define HEIGHT (y2 - y1)
+    if (scale && WIDTH && HEIGHT)
+        setScaleBigger (out, (float) WIDTH / o->width (),
+		        (float) HEIGHT / o->height ());
+#undef WIDTH
+#undef HEIGHT
+    if (restrain)
+	restrainCursor (out);
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+/* Finished here */
+
+bool
+EZoomScreen::zoomBoxActivate (CompAction         *action,
+			     CompAction::State  state,
+			     CompOption::Vector options)
+{
+    grabIndex = screen->pushGrab (None, "ezoom");
+    clickPos.setX (pointerX);
+    clickPos.setY (pointerY);
+    box.setGeometry (pointerX, pointerY, 0, 0);
+    if (state & CompAction::StateInitButton)
+        action->setState (action->state () | CompAction::StateTermButton);
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+bool
+EZoomScreen::zoomBoxDeactivate (CompAction         *action,
+			       CompAction::State  state,
+			       CompOption::Vector options)
+{
+    if (grabIndex)
+    {
+        int        out;
+	int	   x, y, width, height;
+        CompOutput *o;
+
+        screen->removeGrab (grabIndex, NULL);
+        grabIndex = 0;
+        damageZoomedRegion (boxRegion ());
+
+        if (pointerX < clickPos.x ())
+        {
+	    box.setX (pointerX);
+	    box.setWidth (clickPos.x () - pointerX);
+        }
+        else
+        {
+	    box.setWidth (pointerX - clickPos.x ());
+        }
+
+        if (pointerY < clickPos.y ())
+        {
+	    box.setY (pointerY);
+	    box.setHeight (clickPos.y () - pointerY);
+        }
+        else
+        {
+	    box.setHeight (pointerY - clickPos.y ());
+        }
+
+        x = MIN (box.x1 (), box.x2 ());
+        y = MIN (box.y1 (), box.y2 ());
+        width = MAX (box.x1 (), box.x2 ()) - x;
+        height = MAX (box.y1 (), box.y2 ()) - y;
+
+        CompWindow::Geometry outGeometry (x, y, width, height, 0);
+
+        out = screen->outputDeviceForGeometry (outGeometry);
+        o = &screen->outputDevs (). at (out);
+        setScaleBigger (out, (float) width/o->width (), (float)
+		        height/o->height ());
+        setZoomArea (x,y,width,height,false);
+    }
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+/* Zoom in to the area pointed to by the mouse.
+ */
+bool
+EZoomScreen::zoomIn (CompAction         *action,
+		    CompAction::State  state,
+		    CompOption::Vector options)
+{
+    int out = screen->outputDeviceForPoint (pointerX, pointerY);
+
+    if (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
+	!isInMovement (out))
+        setCenter (pointerX, pointerY, true);
+
+    setScale (out,
+	      zooms.at (out).newZoom /
+	      optionGetZoomFactor ());
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+/* Locks down the current zoom area
+ */
+bool
+EZoomScreen::lockZoomAction (CompAction         *action,
+			    CompAction::State  state,
+			    CompOption::Vector options)
+{
+    int out = screen->outputDeviceForPoint (pointerX, pointerY);
+    zooms.at (out).locked = !zooms.at (out).locked;
+
+    return true;
+}
+
+/* Zoom to a specific level.
+ * target defines the target zoom level.
+ * First set the scale level and mark the display as grabbed internally (to
+ * catch the FocusIn event). Either target the focused window or the mouse,
+ * depending on settings.
+ * FIXME: A bit of a mess...
+ */
+bool
+EZoomScreen::zoomSpecific (CompAction         *action,
+			  CompAction::State  state,
+			  CompOption::Vector options,
+			  float		     target)
+{
+    int          x, y;
+    int          out = screen->outputDeviceForPoint (pointerX, pointerY);
+    CompWindow   *w;
+
+    if (target == 1.0f && zooms.at (out).newZoom == 1.0f)
+        return false;
+    if (screen->otherGrabExist (NULL))
+        return false;
+
+    setScale (out, target);
+
+    w = screen->findWindow (screen->activeWindow ());
+    if (optionGetSpecTargetFocus ()
+        && w)
+    {
+        areaToWindow (w);
+    }
+    else
+    {
+        x = CompOption::getIntOptionNamed (options, "x", 0);
+        y = CompOption::getIntOptionNamed (options, "y", 0);
+        setCenter (x, y, false);
+    }
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+/* TODO: Add specific zoom boost::bind's */
+
+/* Zooms to fit the active window to the screen without cutting
+ * it off and targets it.
+ */
+bool
+EZoomScreen::zoomToWindow (CompAction         *action,
+			  CompAction::State  state,
+			  CompOption::Vector options)
+{
+    int        width, height, out;
+    Window     xid;
+    CompWindow *w;
+    CompOutput *o;
+
+    xid = CompOption::getIntOptionNamed (options, "window", 0);
+    w = screen->findWindow (xid);
+    if (!w)
+	return true;
+    width = w->width () + w->border ().left + w->border ().right;
+    height = w->height () + w->border ().top + w->border ().bottom;
+    out = screen->outputDeviceForGeometry (w->geometry ());
+    o = &screen->outputDevs ().at (out);
+    setScaleBigger (out, (float) width/o->width (),
+		    (float) height/o->height ());
+    areaToWindow (w);
+    toggleFunctions (true);
+
+    return true;
 }
 
-/* Make sure the given point + margin is visible;
- * Translate to make it visible if necessary.
- * Returns false if the point isn't on a actively zoomed head
- * or the area is locked. */
 bool
-EZoomScreen::ensureVisibility (int x, int y, int margin)
+EZoomScreen::zoomPan (CompAction         *action,
+		     CompAction::State  state,
+		     CompOption::Vector options,
+		     float		horizAmount,
+		     float		vertAmount)
 {
-    int         zoomX, zoomY;
-    int         out;
-    CompOutput  *o;
+    panZoom (horizAmount, vertAmount);
 
-    out = screen->outputDeviceForPoint (x, y);
-    if (!isActive (out))
-	return false;
+    toggleFunctions (true);
 
-    o = &screen->outputDevs ().at (out);
-    convertToZoomedTarget (out, x, y, &zoomX, &zoomY);
-    ZoomArea &za = zooms.at (out);
-    if (za.locked)
-	return false;
+    return true;
+}
 
-#define FACTOR (za.newZoom / (1.0f - za.newZoom))
-    if (zoomX + margin > o->x2 ())
-	za.xTranslate +=
-	    (FACTOR * (float) (zoomX + margin - o->x2 ())) /
-	    (float) o->width ();
-    else if (zoomX - margin < o->x1 ())
-	za.xTranslate +=
-	    (FACTOR * (float) (zoomX - margin - o->x1 ())) /
-	    (float) o->width ();
+/* Centers the mouse based on zoom level and translation.
+ */
+bool
+EZoomScreen::zoomCenterMouse (CompAction         *action,
+			     CompAction::State  state,
+			     CompOption::Vector options)
+{
+    int        out;
 
-    if (zoomY + margin > o->y2 ())
-	za.yTranslate +=
-	    (FACTOR * (float) (zoomY + margin - o->y2 ())) /
-	    (float) o->height ();
-    else if (zoomY - margin < o->y1 ())
-	za.yTranslate +=
-	    (FACTOR * (float) (zoomY - margin - o->y1 ())) /
-	    (float) o->height ();
-#undef FACTOR
-    constrainZoomTranslate ();
+
+    out = screen->outputDeviceForPoint (pointerX, pointerY);
+    screen->warpPointer ((int) (screen->outputDevs ().at (out).width ()/2 +
+			screen->outputDevs ().at (out).x1 () - pointerX)
+			 + ((float) screen->outputDevs ().at (out).width () *
+				-zooms.at (out).xtrans),
+			 (int) (screen->outputDevs ().at (out).height ()/2 +
+				screen->outputDevs ().at (out).y1 () - pointerY)
+			 + ((float) screen->outputDevs ().at (out).height () *
+				zooms.at (out).ytrans));
     return true;
 }
 
-/* Attempt to ensure the visibility of an area defined by x1/y1 and x2/y2.
- * See ensureVisibility () for details.
- *
- * This attempts to find the translations that leaves the biggest part of
- * the area visible.
- *
- * gravity defines what part of the window that should get
- * priority if it isn't possible to fit all of it.
+/* Resize a window to fit the zoomed area.
+ * This could probably do with some moving-stuff too.
+ * IE: Move the zoom area afterwards. And ensure
+ * the window isn't resized off-screen.
+ */
+bool
+EZoomScreen::zoomFitWindowToZoom (CompAction         *action,
+			         CompAction::State  state,
+			         CompOption::Vector options)
+{
+    int            out;
+    unsigned int   mask = CWWidth | CWHeight;
+    XWindowChanges xwc;
+    CompWindow     *w;
+
+    w = screen->findWindow (CompOption::getIntOptionNamed (
+							 options, "window", 0));
+    if (!w)
+	return true;
+
+    out = screen->outputDeviceForGeometry (w->geometry ());
+    xwc.x = w->serverX ();
+    xwc.y = w->serverY ();
+    xwc.width = (int) (screen->outputDevs ().at (out).width () *
+		       zooms.at (out).currentZoom -
+		       (int) ((w->border ().left + w->border ().right)));
+    xwc.height = (int) (screen->outputDevs ().at (out).height () *
+			zooms.at (out).currentZoom -
+			(int) ((w->border ().top + w->border ().bottom)));
+
+    w->constrainNewWindowSize (xwc.width,
+			       xwc.height,
+			       &xwc.width,
+			       &xwc.height);
+
+
+    if (xwc.width == w->serverWidth ())
+	mask &= ~CWWidth;
+
+    if (xwc.height == w->serverHeight ())
+	mask &= ~CWHeight;
+
+    if (w->mapNum () && (mask & (CWWidth | CWHeight)))
+	w->sendSyncRequest ();
+
+    w->configureXWindow (mask, &xwc);
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+bool
+EZoomScreen::initiate (CompAction         *action,
+		      CompAction::State  state,
+		      CompOption::Vector options)
+{
+    zoomIn (action, state, options);
+
+    if (state & CompAction::StateInitKey)
+	action->setState (action->state () | CompAction::StateTermKey);
+
+    if (state & CompAction::StateInitButton)
+	action->setState (action->state () | CompAction::StateTermButton);
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+bool
+EZoomScreen::zoomOut (CompAction         *action,
+		     CompAction::State  state,
+		     CompOption::Vector options)
+{
+    int out = screen->outputDeviceForPoint (pointerX, pointerY);
+
+    setScale (out,
+	      zooms.at (out).newZoom *
+	      optionGetZoomFactor ());
+
+    toggleFunctions (true);
+
+    return true;
+}
+
+bool
+EZoomScreen::terminate (CompAction         *action,
+		       CompAction::State  state,
+		       CompOption::Vector options)
+{
+    int out;
+
+    out = screen->outputDeviceForPoint (pointerX, pointerY);
+
+    if (grabbed)
+    {
+        zooms.at (out).newZoom = 1.0f;
+        damageOutput (out);
+    }
+
+    toggleFunctions (true);
+
+    action->setState (action->state () & ~(CompAction::StateTermKey |
+					   CompAction::StateTermButton));
+    return false;
+
+}
+
+/* Focus-track related event handling.
+ * The lastMapped is a hack to ensure that newly mapped windows are
+ * caught even if the grab that (possibly) triggered them affected
+ * the mode. Windows created by a key binding (like creating a terminal
+ * on a key binding) tends to trigger FocusIn events with mode other than
+ * Normal. This works around this problem.
+ * The window is not followed right away, cycling through windows or
+ * mapping a bunch of them would animate to each one. followFocus does
+ * once focus stays put.
+ * FIXME: Cleanup.
  */
 void
-EZoomScreen::ensureVisibilityArea (int         x1,
-				  int         y1,
-				  int         x2,
-				  int         y2,
-				  int         margin,
-				  ZoomGravity gravity)
+EZoomScreen::focusTrack (XEvent *event)
+{
+    static Window lastMapped = 0;
+
+    CompWindow    *w;
+    int           delay = optionGetFocusSettleDelay ();
+
+    if (event->type == MapNotify)
+    {
+	lastMapped = event->xmap.window;
+	return;
+    }
+    else if (event->type != FocusIn)
+	return;
+
+    if ((event->xfocus.mode != NotifyNormal)
+	&& (lastMapped != event->xfocus.window))
+	return;
+
+    lastMapped = 0;
+    w = screen->findWindow (event->xfocus.window);
+    if (w == NULL || w->id () == screen->activeWindow ())
+	return;
+
+    focusWindow = w->id ();
+    focusGrabWait = false;
+    focusTimer.setTimes (delay, delay * 5 / 4);
+    focusTimer.start ();
+}
+
+#define FOCUS_GRAB_TIMEOUT 5000 // ms to wait for a grab to end
+
+/* Timer callback, focus has not moved for a while. Follow it unless a
+ * switcher or the like still holds a grab. Then handleEvent calls again
+ * once the grab is gone. The timer only checks back once more, after
+ * FOCUS_GRAB_TIMEOUT, and then leaves the waiting to handleEvent rather
+ * than waking up for as long as the grab lasts.
+ * TODO: Avoid maximized windows.
+ */
+bool
+EZoomScreen::followFocus ()
+{
+    int        out;
+    CompWindow *w;
+
+    if (screen->otherGrabExist ("ezoom", NULL))
+    {
+	if (focusGrabWait)
+	    return false;
+
+	focusGrabWait = true;
+	focusTimer.setTimes (FOCUS_GRAB_TIMEOUT, FOCUS_GRAB_TIMEOUT * 5 / 4);
+	return true;
+    }
+
+    focusGrabWait = false;
+
+    w = screen->findWindow (focusWindow);
+    focusWindow = None;
+    if (w == NULL)
+	return false;
+
+    if (currentMs () - lastChange < optionGetFollowFocusDelay () * 1000u ||
+	!optionGetFollowFocus ())
+	return false;
+
+    out = screen->outputDeviceForGeometry (w->geometry ());
+    if (!isActive (out) &&
+	!optionGetAlwaysFocusFitWindow ())
+	return false;
+    if (optionGetFocusFitWindow ())
+    {
+	int width = w->width () + w->border ().left + w->border ().right;
+	int height = w->height () + w->border ().top + w->border ().bottom;
+	float scale = MAX ((float) width/screen->outputDevs ().at(out).width (),
+			   (float) height/screen->outputDevs ().at (out).height ());
+	if (scale > optionGetAutoscaleMin ())
+		setScale (out, scale);
+    }
+
+    submitTarget (SourceFocus, w->serverInputRect (), w->id (), false);
+
+    toggleFunctions (true);
+
+    return false;
+}
+
+
+/* Event handler. Pass focus-related events on and handle XFixes events. */
+void
+EZoomScreen::handleEvent (XEvent *event)
 {
-    int        targetX, targetY, targetW, targetH;
-    int        out;
-    CompOutput *o;
 
-    out = screen->outputDeviceForPoint (x1 + (x2-x1/2), y1 + (y2-y1/2));
-    o = &screen->outputDevs ().at (out);
+    switch (event->type) {
+	case MotionNotify:
+	    if (grabIndex)
+	    {
+		CompRegion damage = boxRegion ();
 
-#define WIDTHOK (float)(x2-x1) / (float)o->width () < zooms.at (out).newZoom
-#define HEIGHTOK (float)(y2-y1) / (float)o->height () < zooms.at (out).newZoom
+	        if (pointerX < clickPos.x ())
+	        {
+		    box.setX (pointerX);
+		    box.setWidth (clickPos.x () - pointerX);
+	        }
+	        else
+	        {
+		    box.setWidth (pointerX - clickPos.x ());
+	        }
 
-    if (WIDTHOK &&
-	HEIGHTOK) {
-	ensureVisibility (x1, y1, margin);
-	ensureVisibility (x2, y2, margin);
-	return;
-    }
+	        if (pointerY < clickPos.y ())
+	        {
+		    box.setY (pointerY);
+		    box.setHeight (clickPos.y () - pointerY);
+	        }
+	        else
+	        {
+		    box.setHeight (pointerY - clickPos.y ());
+	        }
+		damage += boxRegion ();
+		damageZoomedRegion (damage);
+	    }
+	    wakeUp ();
+	    break;
 
-    switch (gravity)
-    {
-	case NORTHWEST:
-	    targetX = x1;
-	    targetY = y1;
-	    if (WIDTHOK)
-		targetW = x2 - x1;
-	    else
-		targetW = o->width () * zooms.at (out).newZoom;
-	    if (HEIGHTOK)
-		targetH = y2 - y1;
-	    else
-		targetH = o->height () * zooms.at (out).newZoom;
+	case GenericEvent:
+	    if (rawMotionSelected &&
+		event->xcookie.extension == xi2Opcode &&
+		event->xcookie.evtype == XI_RawMotion &&
+		!motionTimer.active ())
+		motionTimer.start ();
 	    break;
-	case NORTHEAST:
-	    targetY = y1;
-	    if (WIDTHOK)
-	    {
-		targetX = x1;
-		targetW = x2-x1;
-	    }
-	    else
-	    {
-		targetX = x2 - o->width () * zooms.at (out).newZoom;
-		targetW = o->width () * zooms.at (out).newZoom;
-	    }
 
-	    if (HEIGHTOK)
-		targetH = y2-y1;
-	    else
-		targetH = o->height () * zooms.at (out).newZoom;
+	case KeyPress:
+	case ButtonPress:
+	case EnterNotify:
+	case LeaveNotify:
+	    wakeUp ();
 	    break;
-	case SOUTHWEST:
-	    targetX = x1;
-	    if (WIDTHOK)
-		targetW = x2-x1;
-	    else
-		targetW = o->width () * zooms.at (out).newZoom;
-	    if (HEIGHTOK)
-	    {
-		targetY = y1;
-		targetH = y2-y1;
-	    }
-	    else
-	    {
-		targetY = y2 - (o->width () * zooms.at (out).newZoom);
-		targetH = o->width () * zooms.at (out).newZoom;
-	    }
+
+	case FocusIn:
+	case MapNotify:
+	    focusTrack (event);
 	    break;
-	case SOUTHEAST:
-	    if (WIDTHOK)
-	    {
-		targetX = x1;
-		targetW = x2-x1;
-	    }
-	    else
-	    {
-		targetW = o->width () * zooms.at (out).newZoom;
-		targetX = x2 - targetW;
-	    }
 
-	    if (HEIGHTOK)
-	    {
-		targetY = y1;
-		targetH = y2 - y1;
-	    }
-	    else
-	    {
-		targetH = o->height () * zooms.at (out).newZoom;
-		targetY = y2 - targetH;
-	    }
+	case ConfigureNotify:
+	    extentQuery.invalidateAll ();
 	    break;
-	case CENTER:
 	default:
-	    setCenter (x1 + (x2 - x1 / 2), y1 + (y2 - y1 / 2), false);
-	    return;
+	    if (event->type == fixesEventBase + XFixesCursorNotify)
+	    {
+		XFixesCursorNotifyEvent *cev = (XFixesCursorNotifyEvent *)
+		    event;
+		    wakeUp ();
+		    if (cursor.isSet)
+		    {
+			CompRegion damage (lastCursorRect);
+			bool       own;
+
+			cursorName = cev->cursor_name;
+			cursorSerial = cev->cursor_serial;
+			own = hwCursorActive &&
+			      ownHardwareCursor (cev->cursor_serial);
+
+			/* Our scaled cursor is already what it should be.
+			 * An unknown one of the same name might be too, its
+			 * image will tell, see collectCursorImage */
+			if (!own && hwCursorActive &&
+			    hwCursors.count (cursorName) &&
+			    hwCursors[cursorName].installed)
+			{
+			    hwVerifySerial = cev->cursor_serial;
+			    requestCursorImage ();
+			}
+			else
+			{
+			    if (!own)
+			    {
+				switchCursor (cev->cursor_serial);
+				lastCursorRect = cursorRect ();
+				damage += lastCursorRect;
+				damageZoomedRegion (damage);
+			    }
+
+			    updateHardwareCursor (!own);
+			}
+		    }
+	    }
 	    break;
     }
 
-    setZoomArea (targetX, targetY, targetW, targetH, false);
-    return ;
+    screen->handleEvent (event);
+
+    if (cursorRequestPending)
+	collectCursorImage ();
+
+    /* The switcher let go, follow the focus it left behind */
+    if (focusGrabWait && !screen->otherGrabExist ("ezoom", NULL))
+    {
+	focusTimer.stop ();
+	followFocus ();
+    }
+
+    if (a11yListener && screen->activeWindow () != a11yWindow)
+	updateAccessibilitySubscriptions ();
 }
 
-/* Ensures that the cursor is visible on the given head.
- * Note that we check if currentZoom is 1.0f, because that often means that
- * mouseX and mouseY is not up-to-date (since the polling timer just
- * started).
- */
+/* Listen for caret moves of one application, or stop to. Applications
+ * only emit the events somebody listens for, and the match rule added on
+ * the bus names that application as the sender, so the text churn of
+ * every other application never reaches us. Any accessible of the
+ * application will do to name it. Focus and bounds changes are always
+ * listened for, see enableAccessibility.  */
 void
-EZoomScreen::restrainCursor (int out)
+EZoomScreen::subscribeAccessibility (AtspiAccessible *app)
 {
-    int         x1, y1, x2, y2, margin;
-    int         diffX = 0, diffY = 0;
-    int         north, south, east, west;
-    float       z;
-    CompOutput  *o = &screen->outputDevs ().at (out);
+    CompString bus;
 
-    z = zooms.at (out).newZoom;
-    margin = optionGetRestrainMargin ();
-    north = distanceToEdge (out, NORTH);
-    south = distanceToEdge (out, SOUTH);
-    east = distanceToEdge (out, EAST);
-    west = distanceToEdge (out, WEST);
+    if (app)
+	bus = AccessibleId (app).bus;
 
-    if (zooms.at (out).currentZoom == 1.0f)
-    {
-	lastChange = time(NULL);
-	mouse = MousePoller::getCurrentPosition ();
-    }
+    if (bus == a11yCaretBus)
+	return;
 
-    convertToZoomedTarget (out, mouse.x () - cursor.hotX,
-			   mouse.y () - cursor.hotY, &x1, &y1);
-    convertToZoomedTarget
-	(out,
-	 mouse.x () - cursor.hotX + cursor.width,
-	 mouse.y () - cursor.hotY + cursor.height,
-	 &x2, &y2);
+    if (!a11yCaretBus.empty ())
+	atspi_event_listener_deregister (a11yListener,
+					 "object:text-caret-moved", NULL);
+    a11yCaretBus.clear ();
 
-    if ((x2 - x1 > o->x2 () - o->x1 ()) ||
-       (y2 - y1 > o->y2 () - o->y1 ()))
+    if (!bus.empty () &&
+	atspi_event_listener_register_with_app (a11yListener,
+						"object:text-caret-moved",
+						NULL, app, NULL))
+	a11yCaretBus = bus;
+}
+
+/* Only follow the caret while the active window is one that can be typed
+ * into, and only in the application it belongs to. Focus events still
+ * come in from everywhere, they tell us which one that is, see
+ * followAccessibleApp.  */
+void
+EZoomScreen::updateAccessibilitySubscriptions ()
+{
+    CompWindow   *w;
+    unsigned int textMask = CompWindowTypeNormalMask |
+			    CompWindowTypeDialogMask |
+			    CompWindowTypeModalDialogMask |
+			    CompWindowTypeUtilMask;
+
+    if (!a11yListener)
 	return;
-    if (x2 > o->x2 () - margin && east > 0)
-	diffX = x2 - o->x2 () + margin;
-    else if (x1 < o->x1 () + margin && west > 0)
-	diffX = x1 - o->x1 () - margin;
 
-    if (y2 > o->y2 () - margin && south > 0)
-	diffY = y2 - o->y2 () + margin;
-    else if (y1 < o->y1 () + margin && north > 0)
-	diffY = y1 - o->y1 () - margin;
+    a11yWindow = screen->activeWindow ();
+    w = screen->findWindow (a11yWindow);
 
-    if (abs(diffX)*z > 0  || abs(diffY)*z > 0)
-	screen->warpPointer ((int) (mouse.x () - pointerX) -
-						       (int) ((float)diffX * z),
-		     	     (int) (mouse.y () - pointerY) -
-						      (int) ((float)diffY * z));
+    a11yWindowPid = w ? screen->getWindowProp (a11yWindow, Atoms::wmPid, 0) :
+			0;
+    a11yTextWindow = w && (w->type () & textMask);
+
+    if (a11yTextWindow && a11yFocusSource &&
+	accessibleInActiveApp (AccessibleId (a11yFocusSource)))
+	subscribeAccessibility (a11yFocusSource);
+    else
+	subscribeAccessibility (NULL);
 }
 
-/* Check if the cursor is still visible.
- * We also make sure to activate/deactivate cursor scaling here
- * so we turn on/off the pointer if it moves from one head to another.
- * FIXME: Detect an actual output change instead of spamming.
- * FIXME: The second ensureVisibility (sync with restrain).
- */
+/* Whether the bus says the application an accessible belongs to is the
+ * process of the active window. A different or missing process does not
+ * say it is not, sandboxed and remote applications show up as some other
+ * process than the window claims. Their targets are told apart by where
+ * they are, see followAccessibleRect.  */
+bool
+EZoomScreen::accessibleInActiveApp (const AccessibleId &id)
+{
+    return a11yWindowPid > 0 &&
+	   a11yProcesses.lookup (id.bus) == a11yWindowPid;
+}
+
+/* The latest focus went to the application of the active window, listen
+ * for its caret. Called once its process is known, handleExtents does the
+ * same once its extents turn out to lie in that window.  */
 void
-EZoomScreen::cursorMoved ()
+EZoomScreen::followAccessibleApp ()
 {
-    int         out;
+    if (a11yTextWindow && a11yFocusSource &&
+	accessibleInActiveApp (AccessibleId (a11yFocusSource)))
+	subscribeAccessibility (a11yFocusSource);
+}
 
-    out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
-    if (isActive (out))
+/* libatspi hands over a copy of the event, ours to free */
+void
+EZoomScreen::accessibilityEvent (AtspiEvent *event,
+				 void       *data)
+{
+    ((EZoomScreen *) data)->handleAccessibilityEvent (event);
+
+    g_boxed_free (ATSPI_TYPE_EVENT, event);
+}
+
+/* Accessibility events can arrive by the thousand, like a terminal
+ * printing a build log. They are only recorded here, the latest focus and
+ * caret targets are looked up and followed once per frame by
+ * applyAccessibilityTargets.  */
+void
+EZoomScreen::handleAccessibilityEvent (const AtspiEvent *event)
+{
+    AccessibleId id (event->source);
+    bool         coalesced = false;
+
+    if (id.empty ())
+	return;
+
+    /* Whatever we know about where it is is out of date */
+    if (!strcmp (event->type, "object:bounds-changed"))
     {
-	if (optionGetRestrainMouse ())
-	    restrainCursor (out);
+	extentQuery.invalidate (id);
+	return;
+    }
 
-	if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
-	{
-	    ensureVisibilityArea (mouse.x () - cursor.hotX,
-				  mouse.y () - cursor.hotY,
-				  mouse.x () + cursor.width -
-				  cursor.hotX,
-				  mouse.y () + cursor.height -
-				  cursor.hotY,
-				  optionGetRestrainMargin (),
-				  NORTHWEST);
-	}
+    /* Nothing to follow at 1.0x, the listeners only stay for a while
+     * in case we zoom in again */
+    if (!grabbed)
+	return;
 
-	cursorZoomActive (out);
+    a11yStats.received++;
+
+    if (!strcmp (event->type, "object:text-caret-moved"))
+    {
+	if (!a11yPendingCaret.empty ())
+	    coalesced = true;
+	a11yPendingCaret = id;
+	a11yPendingOffset = event->detail1;
     }
-    else
+    else if (event->detail1) // gained focus, not lost it
     {
-	cursorZoomInactive ();
+	if (!a11yPendingFocus.empty ())
+	    coalesced = true;
+	a11yPendingFocus = id;
+
+	/* Whatever the caret did, it did somewhere else */
+	caretMotion.valid = false;
+
+	if (a11yFocusSource)
+	    g_object_unref (a11yFocusSource);
+	a11yFocusSource = (AtspiAccessible *) g_object_ref (event->source);
+	followAccessibleApp ();
     }
+    else
+	return;
+
+    if (coalesced)
+	a11yStats.coalesced++;
+
+    scheduleAccessibilityTargets ();
 }
 
-/* Update the mouse position.
- * Based on the zoom engine in use, we will have to move the zoom area.
- * This might have to be added to a timer.
- */
+/* Apply the targets with the next frame */
 void
-EZoomScreen::updateMousePosition (const CompPoint &p)
+EZoomScreen::scheduleAccessibilityTargets ()
 {
-    int out;
-    mouse.setX (p.x ());
-    mouse.setY (p.y ());
-    out = screen->outputDeviceForPoint (mouse.x (), mouse.y ());
-    lastChange = time(NULL);
-    if (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
-        !isInMovement (out))
-	setCenter (mouse.x (), mouse.y (), true);
-    cursorMoved ();
-    cScreen->damageScreen ();
+    if (!a11yTimer.active ())
+    {
+	a11yTimer.setTimes (cScreen->redrawTime (),
+			    cScreen->redrawTime () * 3 / 2);
+	a11yTimer.start ();
+    }
 }
 
-/* Timeout handler to poll the mouse. Returns false (and thereby does not
- * get re-added to the queue) when zoom is not active. */
-void
-EZoomScreen::updateMouseInterval (const CompPoint &p)
+#define CARET_LEAD_TIME 500 // ms of typing the view stays ahead of
+#define CARET_IDLE_TIME 1000 // ms after which typing starts over
+#define CARET_MAX_STEP 4 // characters, a longer move is not typing
+
+/* Follow an accessible rectangle, if it lies inside the active window.
+ * This is what keeps targets of background applications out. The view
+ * is kept ahead of a moving caret, see predictCaret. Returns whether the
+ * rectangle was followed.
+ *
+ * A focused widget is where the window focus went, it is followed as
+ * focus. So it replaces the window when it arrives right after a window
+ * switch, rather than being held off by it.  */
+bool
+EZoomScreen::followAccessibleRect (const CompRect &rect, bool caret)
 {
-    updateMousePosition (p);
+    CompWindow *w = screen->findWindow (screen->activeWindow ());
+    CompRect   target (rect);
+    bool       wrapped = false;
 
-    if (!grabbed)
+    if (!w || !w->inputRect ().intersects (rect))
+    {
+	a11yStats.ignored++;
+	return false;
+    }
+
+    a11yStats.applied++;
+
+    if (caret)
+	target = predictCaret (rect, wrapped);
+
+    /* One jump to a new line, not an animation back across it */
+    if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
+	submitTarget (caret ? SourceCaret : SourceFocus, target, None,
+		      wrapped);
+
+    return true;
+}
+
+int
+EZoomScreen::targetPriority (TargetSource source)
+{
+    switch (source)
     {
-	cursorMoved ();
-	if (pollHandle.active ())
-	    pollHandle.stop ();
+	case SourceMouse:
+	    return optionGetMousePriority ();
+	case SourceFocus:
+	    return optionGetFocusPriority ();
+	case SourceCaret:
+	default:
+	    return optionGetCaretPriority ();
     }
 }
 
-/* Free a cursor */
-void
-EZoomScreen::freeCursor (CursorTexture * cursor)
+int
+EZoomScreen::targetHold (TargetSource source)
 {
-    if (!cursor->isSet)
-	return;
-
-    cursor->isSet = false;
-    glDeleteTextures (1, &cursor->texture);
-    cursor->texture = 0;
+    switch (source)
+    {
+	case SourceMouse:
+	    return optionGetMouseHold ();
+	case SourceFocus:
+	    return optionGetFocusHold ();
+	case SourceCaret:
+	default:
+	    return optionGetCaretHold ();
+    }
 }
 
-/* Translate into place and draw the scaled cursor.  */
-void
-EZoomScreen::drawCursor (CompOutput          *output,
-	    		const GLMatrix      &transform)
+/* A source of higher priority moved the zoom area recently enough that
+ * this one should leave it alone. Returns how many ms that lasts, 0 if it
+ * is not held.  */
+unsigned int
+EZoomScreen::targetHeld (TargetSource source)
 {
-    int         out = output->id ();
+    unsigned int now = currentMs ();
+    unsigned int left = 0;
 
-    if (cursor.isSet)
+    for (int s = 0; s < SourceCount; s++)
     {
-	GLMatrix      sTransform = transform;
-	float	      scaleFactor;
-	int           ax, ay, x, y;
-
-	/*
-	 * XXX: expo knows how to handle mouse when zoomed, so we back off
-	 * when expo is active.
-	 */
-	if (screen->grabExist ( "expo"))
-	{
-	    cursorZoomInactive ();
-	    return;
-	}
+	Target &t = targets[s];
 
-	sTransform.toScreenSpace (output, -DEFAULT_Z_CAMERA);
-	convertToZoomed (out, mouse.x (), mouse.y (), &ax, &ay);
-        glPushMatrix ();
-	glLoadMatrixf (sTransform.getMatrix ());
-	glTranslatef ((float) ax, (float) ay, 0.0f);
-	if (optionGetScaleMouseDynamic ())
-	    scaleFactor = 1.0f / zooms.at (out).currentZoom;
-	else
-	    scaleFactor = 1.0f / optionGetScaleMouseStatic ();
-	glScalef (scaleFactor,
-		  scaleFactor,
-		  1.0f);
-	x = -cursor.hotX;
-	y = -cursor.hotY;
+	if (s == source || !t.committed ||
+	    targetPriority ((TargetSource) s) <= targetPriority (source))
+	    continue;
 
-	glEnable (GL_BLEND);
-	glBindTexture (GL_TEXTURE_RECTANGLE_ARB, cursor.texture);
-	glEnable (GL_TEXTURE_RECTANGLE_ARB);
+	unsigned int hold = targetHold ((TargetSource) s);
 
-	glBegin (GL_QUADS);
-	glTexCoord2d (0, 0);
-	glVertex2f (x, y);
-	glTexCoord2d (0, cursor.height);
-	glVertex2f (x, y + cursor.height);
-	glTexCoord2d (cursor.width, cursor.height);
-	glVertex2f (x + cursor.width, y + cursor.height);
-	glTexCoord2d (cursor.width, 0);
-	glVertex2f (x + cursor.width, y);
-	glEnd ();
-	glDisable (GL_BLEND);
-	glBindTexture (GL_TEXTURE_RECTANGLE_ARB, 0);
-	glDisable (GL_TEXTURE_RECTANGLE_ARB);
-	glPopMatrix ();
+	if (now - t.committedAt < hold)
+	    left = MAX (left, hold - (now - t.committedAt));
     }
+
+    return left;
 }
 
-/* Create (if necessary) a texture to store the cursor,
- * fetch the cursor with XFixes. Store it.  */
+/* Wake up again once the first of the held targets is free to go */
 void
-EZoomScreen::updateCursor (CursorTexture * cursor)
+EZoomScreen::scheduleHeldTargets ()
 {
-    unsigned char *pixels;
-    int           i;
-    Display       *dpy = screen->dpy ();
+    unsigned int first = 0;
 
-    if (!cursor->isSet)
+    for (int s = 0; s < SourceCount; s++)
     {
-	cursor->isSet = true;
-	cursor->screen = screen;
-	glEnable (GL_TEXTURE_RECTANGLE_ARB);
-	glGenTextures (1, &cursor->texture);
-	glBindTexture (GL_TEXTURE_RECTANGLE_ARB, cursor->texture);
+	unsigned int left;
 
-	glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
-			 GL_TEXTURE_WRAP_S, GL_CLAMP);
-	glTexParameteri (GL_TEXTURE_RECTANGLE_ARB,
-			 GL_TEXTURE_WRAP_T, GL_CLAMP);
-    } else {
-	glEnable (GL_TEXTURE_RECTANGLE_ARB);
+	if (!targets[s].pending)
+	    continue;
+
+	left = targetHeld ((TargetSource) s);
+	if (left && (!first || left < first))
+	    first = left;
     }
 
-    XFixesCursorImage *ci = XFixesGetCursorImage (dpy);
+    holdTimer.stop ();
 
-    if (ci)
+    if (first)
     {
-	cursor->width = ci->width;
-	cursor->height = ci->height;
-	cursor->hotX = ci->xhot;
-	cursor->hotY = ci->yhot;
-	pixels = (unsigned char *) malloc (ci->width * ci->height * 4);
-
-	if (!pixels)
-	{
-	    XFree (ci);
-	    return;
-	}
-
-	for (i = 0; i < ci->width * ci->height; i++)
-	{
-	    unsigned long pix = ci->pixels[i];
-	    pixels[i * 4] = pix & 0xff;
-	    pixels[(i * 4) + 1] = (pix >> 8) & 0xff;
-	    pixels[(i * 4) + 2] = (pix >> 16) & 0xff;
-	    pixels[(i * 4) + 3] = (pix >> 24) & 0xff;
-	}
-
-	XFree (ci);
+	holdTimer.setTimes (first, first + cScreen->redrawTime ());
+	holdTimer.start ();
     }
-    else
-    {
-	/* Fallback R: 255 G: 255 B: 255 A: 255
-	 * FIXME: Draw a cairo mouse cursor */
+}
 
-	cursor->width = 1;
-	cursor->height = 1;
-	cursor->hotX = 0;
-	cursor->hotY = 0;
-	pixels = (unsigned char *) malloc (cursor->width * cursor->height * 4);
+bool
+EZoomScreen::holdTimeout ()
+{
+    wakeUp ();
+    cScreen->damagePending ();
 
-	if (!pixels)
-	    return;
+    return false;
+}
 
-	for (i = 0; i < cursor->width * cursor->height; i++)
-	{
-	    unsigned long pix = 0x00ffffff;
-	    pixels[i * 4] = pix & 0xff;
-	    pixels[(i * 4) + 1] = (pix >> 8) & 0xff;
-	    pixels[(i * 4) + 2] = (pix >> 16) & 0xff;
-	    pixels[(i * 4) + 3] = (pix >> 24) & 0xff;
-	}
+/* Mouse, focus and caret tracking each want the zoom area somewhere
+ * else. Rather than moving it at once and restarting each other's
+ * animations, they hand in their latest target and commitTarget picks
+ * one per frame. A target held off by another source waits for the hold
+ * to end, only the latest one is kept.  */
+void
+EZoomScreen::submitTarget (TargetSource   source,
+			   const CompRect &rect,
+			   Window         window,
+			   bool           jump)
+{
+    Target &t = targets[source];
 
-	compLogMessage ("ezoom", CompLogLevelWarn, "unable to get system cursor image!");
+    /* A jump stays a jump until it is made */
+    t.jump = jump || (t.pending && t.jump);
+    t.rect = rect;
+    t.window = window;
+    t.pending = true;
+
+    if (targetHeld (source))
+    {
+	scheduleHeldTargets ();
+	return;
     }
 
-    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, cursor->texture);
-    glTexImage2D (GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGBA, cursor->width,
-		  cursor->height, 0, GL_BGRA, GL_UNSIGNED_BYTE, pixels);
-    glBindTexture (GL_TEXTURE_RECTANGLE_ARB, 0);
-    glDisable (GL_TEXTURE_RECTANGLE_ARB);
-	
-    free (pixels);
+    /* Ask for a frame to commit it in */
+    wakeUp ();
+    cScreen->damagePending ();
 }
 
-/* We are no longer zooming the cursor, so display it.  */
+/* Called once per frame. Move the zoom area to the pending target of
+ * the highest priority, the others are stale by the next frame. Held
+ * targets stay pending until their hold ends.  */
 void
-EZoomScreen::cursorZoomInactive ()
+EZoomScreen::commitTarget ()
 {
-    if (!fixesSupported)
-	return;
+    int best = -1;
 
-    if (cursorInfoSelected)
+    for (int s = 0; s < SourceCount; s++)
     {
-	cursorInfoSelected = false;
-	XFixesSelectCursorInput (screen->dpy (), screen->root (), 0);
+	if (!targets[s].pending || targetHeld ((TargetSource) s))
+	    continue;
+
+	if (best < 0 ||
+	    targetPriority ((TargetSource) s) >
+	    targetPriority ((TargetSource) best))
+	    best = s;
     }
 
-    if (cursor.isSet)
+    for (int s = 0; s < SourceCount; s++)
     {
-	freeCursor (&cursor);
+	if (s == best || !targetHeld ((TargetSource) s))
+	    targets[s].pending = false;
     }
 
-    if (cursorHidden)
+    if (best < 0)
     {
-	cursorHidden = false;
-	XFixesShowCursor (screen->dpy (), screen->root ());
+	if (!holdTimer.active ())
+	    scheduleHeldTargets ();
+	return;
+    }
+
+    Target     &t = targets[best];
+    CompRect   &r = t.rect;
+    int        out = screen->outputDeviceForPoint (r.centerX (), r.centerY ());
+    CompWindow *w = t.window ? screen->findWindow (t.window) : NULL;
+
+    t.committed = true;
+    t.committedAt = currentMs ();
+
+    /* Which may hold off the targets left pending a while longer */
+    scheduleHeldTargets ();
+
+    if (w)
+	areaToWindow (w);
+    else
+	ensureVisibilityArea (r.x1 (), r.y1 (), r.x2 (), r.y2 (),
+			      optionGetRestrainMargin (), NORTHWEST);
+
+    if (t.jump && isActive (out))
+    {
+	ZoomArea &za = zooms.at (out);
+
+	za.realXTranslate = za.xTranslate;
+	za.realYTranslate = za.yTranslate;
+	za.xVelocity = za.yVelocity = 0.0f;
+	za.updateActualTranslates ();
+	damageOutput (out);
     }
 }
 
-/* Cursor zoom is active: We need to hide the original,
- * register for Cursor notifies and display the new one.
- * This can be called multiple times, not just on initial
- * activation.
- */
-void
-EZoomScreen::cursorZoomActive (int out)
+/* Extend a caret rectangle by where the caret is likely to be a moment
+ * from now, so the view starts panning before the caret reaches the
+ * edge. Moving to the start of the next line keeps the lead of the
+ * previous one and sets wrapped, the view should go there at once.
+ * Jumps along the line, like Home, End or a click, are not typing and
+ * start over.  */
+CompRect
+EZoomScreen::predictCaret (const CompRect &rect, bool &wrapped)
 {
-    if (!fixesSupported)
-	return;
+    CaretMotion  &cm = caretMotion;
+    unsigned int now = currentMs ();
+    unsigned int elapsed = now - cm.stamp;
+    int          out, lead, maxLead;
+    int          line = MAX (rect.height (), 1);
+    int          step = MAX (rect.width (), line / 2) * CARET_MAX_STEP;
+    int          dx = rect.x () - cm.last.x ();
 
-    /* Force cursor hiding and mouse panning if this output is locked
-     * and cursor hiding is not enabled and we are syncing the mouse
-     */
-
-    if (!optionGetScaleMouse () &&
-        (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
-	 optionGetHideOriginalMouse () &&
-	 !zooms.at (out).locked))
-	return;
+    wrapped = false;
 
-    if (!cursorInfoSelected)
+    if (!cm.valid || elapsed > CARET_IDLE_TIME)
     {
-	cursorInfoSelected = true;
-        XFixesSelectCursorInput (screen->dpy (), screen->root (),
-				 XFixesDisplayCursorNotifyMask);
-	updateCursor (&cursor);
+	cm.velocity = 0.0f;
     }
-    if (canHideCursor && !cursorHidden &&
-	(optionGetHideOriginalMouse () ||
-	 zooms.at (out).locked))
+    else if (abs (rect.centerY () - cm.last.centerY ()) < line / 2)
     {
-	cursorHidden = true;
-	XFixesHideCursor (screen->dpy (), screen->root ());
+	if (abs (dx) > step)
+	    cm.velocity = 0.0f;
+	else
+	    cm.velocity = (cm.velocity + (float) dx / MAX (elapsed, 1)) / 2.0f;
+    }
+    else
+    {
+	/* Back to where the previous line was typed from */
+	wrapped = rect.centerY () > cm.last.centerY () &&
+		  dx * cm.velocity < 0;
+	if (!wrapped)
+	    cm.velocity = 0.0f;
     }
+
+    cm.valid = true;
+    cm.last = rect;
+    cm.stamp = now;
+
+    out = screen->outputDeviceForPoint (rect.centerX (), rect.centerY ());
+    maxLead = screen->outputDevs ().at (out).width () *
+	      zooms.at (out).newZoom / 3;
+    lead = cm.velocity * CARET_LEAD_TIME;
+    if (wrapped)
+	lead = cm.velocity > 0 ? maxLead : -maxLead;
+    lead = MAX (-maxLead, MIN (lead, maxLead));
+
+    if (lead > 0)
+	return CompRect (rect.x (), rect.y (), rect.width () + lead,
+			 rect.height ());
+
+    return CompRect (rect.x () + lead, rect.y (), rect.width () - lead,
+		     rect.height ());
 }
 
-/* Set the zoom area
- * This is an interface for scripting.
- * int32:x1: left x coordinate
- * int32:y1: top y coordinate
- * int32:x2: right x
- * int32:y2: bottom y
- * x2 and y2 can be omitted to assume x1==x2+1 y1==y2+1
- * boolean:scale: True if we should modify the zoom level, false to just
- *                adjust the movement/translation.
- * boolean:restrain: True to warp the pointer so it's visible.
- */
+/* Timer callback, once per frame while accessibility events arrive.
+ * The targets are looked up by extentQuery, handleExtents follows them
+ * once their rectangles come back.  */
 bool
-EZoomScreen::setZoomAreaAction (CompAction         *action,
-			       CompAction::State  state,
-			       CompOption::Vector options)
+EZoomScreen::applyAccessibilityTargets ()
 {
-    int        x1, y1, x2, y2, out;
-    bool       scale, restrain;
-    CompOutput *o;
+    if (!a11yPendingFocus.empty ())
+	requestAccessibleExtents (a11yPendingFocus, false, 0);
 
-    x1 = CompOption::getIntOptionNamed (options, "x1", -1);
-    y1 = CompOption::getIntOptionNamed (options, "y1", -1);
-    x2 = CompOption::getIntOptionNamed (options, "x2", -1);
-    y2 = CompOption::getIntOptionNamed (options, "y2", -1);
-    scale = CompOption::getBoolOptionNamed (options, "scale", false);
-    restrain = CompOption::getBoolOptionNamed (options, "restrain", false);
+    if (!a11yPendingCaret.empty ())
+	requestAccessibleExtents (a11yPendingCaret, true, a11yPendingOffset);
 
-    if (x1 < 0 || y1 < 0)
-        return false;
+    publishAccessibilityStats (false);
 
-    if (x2 < 0)
-        x2 = x1 + 1;
+    /* Storms are worth knowing about, but not one message per event */
+    if (a11yStats.coalesced - a11yStats.reported >= 1000)
+    {
+	a11yStats.reported = a11yStats.coalesced;
+	compLogMessage ("ezoom", CompLogLevelDebug,
+			"accessibility: %u events received, %u coalesced, "
+			"%u targets followed, %u ignored, %u lookups failed, "
+			"%u cached extents used",
+			a11yStats.received, a11yStats.coalesced,
+			a11yStats.applied, a11yStats.ignored,
+			extentQuery.failed (), extentQuery.cacheHits ());
+    }
 
-    if (y2 < 0)
-        y2 = y1 + 1;
+    return false;
+}
 
-    out = screen->outputDeviceForPoint (x1, y1);
-#define WIDTH (x2 - x1)
-#define HEIGHT (y2 - y1)
-    setZoomArea (x1, y1, WIDTH, HEIGHT, false);
-    o = &screen->outputDevs (). at(out);
-    if (scale && WIDTH && HEIGHT)
-        setScaleBigger (out, (float) WIDTH / o->width (),
-		        (float) HEIGHT / o->height ());
-#undef WIDTH
-#undef HEIGHT
-	if (restrain)
-	    restrainCursor (out);
+/* Put the counters on the root window as _COMPIZ_EZOOM_ACCESSIBILITY_STATS,
+ * for monitoring with xprop and the like: events received, coalesced,
+ * targets followed, ignored, lookups failed and cached extents used.
+ * At most once a second, unless forced.  */
+void
+EZoomScreen::publishAccessibilityStats (bool force)
+{
+    unsigned int now = currentMs ();
+    long         values[6];
 
-    toggleFunctions (true);
+    if (!force && now - a11yStats.publishedAt < 1000)
+	return;
 
-    return true;
+    a11yStats.publishedAt = now;
+
+    values[0] = a11yStats.received;
+    values[1] = a11yStats.coalesced;
+    values[2] = a11yStats.applied;
+    values[3] = a11yStats.ignored;
+    values[4] = extentQuery.failed ();
+    values[5] = extentQuery.cacheHits ();
+
+    XChangeProperty (screen->dpy (), screen->root (), a11yStatsAtom,
+		     XA_CARDINAL, 32, PropModeReplace,
+		     (unsigned char *) values, 6);
 }
 
-/* Ensure visibility of an area defined by x1->x2/y1->y2
- * int:x1: left X coordinate
- * int:x2: right X Coordinate
- * int:y1: top Y coordinate
- * int:y2: bottom Y coordinate
- * bool:scale: zoom out if necessary to ensure visibility
- * bool:restrain: Restrain the mouse cursor
- * int:margin: The margin to use (default: 0)
- * if x2/y2 is omitted, it is ignored.
- */
-bool
-EZoomScreen::ensureVisibilityAction (CompAction         *action,
-			            CompAction::State  state,
-			            CompOption::Vector options)
+/* Look up one target and clear it */
+void
+EZoomScreen::requestAccessibleExtents (AccessibleId &id,
+				       bool         caret,
+				       int          offset)
 {
-    int        x1, y1, x2, y2, margin, out;
-    bool       scale, restrain;
-    CompOutput *o;
+    if (extentQuery.request (id, caret, offset))
+	a11yStats.coalesced++;
 
-    x1 = CompOption::getIntOptionNamed (options, "x1", -1);
-    y1 = CompOption::getIntOptionNamed (options, "y1", -1);
-    x2 = CompOption::getIntOptionNamed (options, "x2", -1);
-    y2 = CompOption::getIntOptionNamed (options, "y2", -1);
-    margin = CompOption::getBoolOptionNamed (options, "margin", 0);
-    scale = CompOption::getBoolOptionNamed (options, "scale", false);
-    restrain = CompOption::getBoolOptionNamed (options, "restrain", false);
-    if (x1 < 0 || y1 < 0)
-        return false;
-    if (x2 < 0)
-        y2 = y1 + 1;
-    out = screen->outputDeviceForPoint (x1, y1);
-    ensureVisibility (x1, y1, margin);
-    if (x2 >= 0 && y2 >= 0)
-        ensureVisibility (x2, y2, margin);
-    o = &screen->outputDevs (). at(out);
-#define WIDTH (x2 - x1)
-#define HEIGHT (y2 - y1)
-    if (scale && WIDTH && HEIGHT)
-        setScaleBigger (out, (float) WIDTH / o->width (),
-		        (float) HEIGHT / o->height ());
-#undef WIDTH
-#undef HEIGHT
-    if (restrain)
-	restrainCursor (out);
+    id = AccessibleId ();
+}
+
+/* extentQuery has a rectangle for us. A focus that turns out to lie in
+ * the active window tells which application to listen for the caret of,
+ * if the bus could not.  */
+void
+EZoomScreen::handleExtents (const AccessibleId &id,
+			    const CompRect     &rect,
+			    bool               caret)
+{
+    if (!grabbed)
+	return;
+
+    if (followAccessibleRect (rect, caret) && !caret && a11yTextWindow &&
+	a11yFocusSource && AccessibleId (a11yFocusSource).bus == id.bus)
+	subscribeAccessibility (a11yFocusSource);
+
+    wakeUp ();
+}
 
-    toggleFunctions (true);
+EZoomScreen::AccessibleId::AccessibleId ()
+{
+}
 
-    return true;
+EZoomScreen::AccessibleId::AccessibleId (AtspiAccessible *accessible)
+{
+    if (!accessible || !accessible->parent.app ||
+	!accessible->parent.app->bus_name || !accessible->parent.path)
+	return;
+
+    bus = accessible->parent.app->bus_name;
+    path = accessible->parent.path;
 }
 
-/* Finished here */
+bool
+EZoomScreen::AccessibleId::empty () const
+{
+    return bus.empty ();
+}
 
 bool
-EZoomScreen::zoomBoxActivate (CompAction         *action,
-			     CompAction::State  state,
-			     CompOption::Vector options)
+EZoomScreen::AccessibleId::operator< (const AccessibleId &other) const
 {
-    grabIndex = screen->pushGrab (None, "ezoom");
-    clickPos.setX (pointerX);
-    clickPos.setY (pointerY);
-    box.setGeometry (pointerX, pointerY, 0, 0);
-    if (state & CompAction::StateInitButton)
-        action->setState (action->state () | CompAction::StateTermButton);
+    if (bus != other.bus)
+	return bus < other.bus;
 
-    toggleFunctions (true);
+    return path < other.path;
+}
 
-    return true;
+EZoomScreen::ExtentQuery::CacheEntry::CacheEntry () :
+    hasExtents (false),
+    used (0)
+{
+}
+
+EZoomScreen::ExtentQuery::Call::Call () :
+    pending (NULL)
+{
+}
+
+EZoomScreen::ExtentQuery::ExtentQuery () :
+    errors (0),
+    hits (0),
+    useCount (0)
+{
+}
+
+EZoomScreen::ExtentQuery::~ExtentQuery ()
+{
+    cancel ();
+}
+
+void
+EZoomScreen::ExtentQuery::setCallback (const Callback &cb)
+{
+    callback = cb;
 }
 
+/* Look up the extents of an accessible, or of the character at offset
+ * if caret is set. Known extents go to the callback right away.
+ * Returns true if this replaced a call still waiting for its reply.  */
 bool
-EZoomScreen::zoomBoxDeactivate (CompAction         *action,
-			       CompAction::State  state,
-			       CompOption::Vector options)
+EZoomScreen::ExtentQuery::request (const AccessibleId &id,
+				   bool               caret,
+				   int                offset)
 {
-    if (grabIndex)
-    {
-        int        out;
-	int	   x, y, width, height;
-        CompOutput *o;
+    DBusConnection *bus = atspi_get_a11y_bus ();
+    DBusMessage    *message;
+    Call           &call = calls[caret ? 1 : 0];
+    bool           replaced = call.pending != NULL;
+    dbus_uint32_t  coordType = 0; // ATSPI_COORD_TYPE_SCREEN
 
-        screen->removeGrab (grabIndex, NULL);
-        grabIndex = 0;
+    cancel (call);
 
-        if (pointerX < clickPos.x ())
-        {
-	    box.setX (pointerX);
-	    box.setWidth (clickPos.x () - pointerX);
-        }
-        else
-        {
-	    box.setWidth (pointerX - clickPos.x ());
-        }
+    if (!caret)
+    {
+	CacheEntry &entry = cacheEntry (id);
 
-        if (pointerY < clickPos.y ())
-        {
-	    box.setY (pointerY);
-	    box.setHeight (clickPos.y () - pointerY);
-        }
-        else
-        {
-	    box.setHeight (pointerY - clickPos.y ());
-        }
+	if (entry.hasExtents)
+	{
+	    hits++;
+	    callback (id, entry.extents, false);
+	    return replaced;
+	}
+    }
 
-        x = MIN (box.x1 (), box.x2 ());
-        y = MIN (box.y1 (), box.y2 ());
-        width = MAX (box.x1 (), box.x2 ()) - x;
-        height = MAX (box.y1 (), box.y2 ()) - y;
+    if (!bus)
+	return replaced;
 
-        CompWindow::Geometry outGeometry (x, y, width, height, 0);
+    if (caret)
+    {
+	dbus_int32_t characterOffset = offset;
+
+	message = dbus_message_new_method_call (id.bus.c_str (),
+						id.path.c_str (),
+						"org.a11y.atspi.Text",
+						"GetCharacterExtents");
+	if (message)
+	    dbus_message_append_args (message,
+				      DBUS_TYPE_INT32, &characterOffset,
+				      DBUS_TYPE_UINT32, &coordType,
+				      DBUS_TYPE_INVALID);
+    }
+    else
+    {
+	message = dbus_message_new_method_call (id.bus.c_str (),
+						id.path.c_str (),
+						"org.a11y.atspi.Component",
+						"GetExtents");
+	if (message)
+	    dbus_message_append_args (message,
+				      DBUS_TYPE_UINT32, &coordType,
+				      DBUS_TYPE_INVALID);
+    }
 
-        out = screen->outputDeviceForGeometry (outGeometry);
-        o = &screen->outputDevs (). at (out);
-        setScaleBigger (out, (float) width/o->width (), (float)
-		        height/o->height ());
-        setZoomArea (x,y,width,height,false);
+    if (!message)
+	return replaced;
+
+    if (dbus_connection_send_with_reply (bus, message, &call.pending,
+					 callTimeout) && call.pending)
+    {
+	call.id = id;
+	dbus_pending_call_set_notify (call.pending, &ExtentQuery::replied,
+				      this, NULL);
     }
+    else
+	call.pending = NULL;
 
-    toggleFunctions (true);
+    dbus_message_unref (message);
 
-    return true;
+    return replaced;
 }
 
-/* Zoom in to the area pointed to by the mouse.
- */
-bool
-EZoomScreen::zoomIn (CompAction         *action,
-		    CompAction::State  state,
-		    CompOption::Vector options)
+/* Drop the calls still waiting, their replies are not wanted */
+void
+EZoomScreen::ExtentQuery::cancel ()
 {
-    int out = screen->outputDeviceForPoint (pointerX, pointerY);
-
-    if (optionGetZoomMode () == EzoomOptions::ZoomModeSyncMouse &&
-	!isInMovement (out))
-        setCenter (pointerX, pointerY, true);
-
-    setScale (out,
-	      zooms.at (out).newZoom /
-	      optionGetZoomFactor ());
+    cancel (calls[0]);
+    cancel (calls[1]);
+}
 
-    toggleFunctions (true);
+void
+EZoomScreen::ExtentQuery::cancel (Call &call)
+{
+    if (!call.pending)
+	return;
 
-    return true;
+    dbus_pending_call_cancel (call.pending);
+    dbus_pending_call_unref (call.pending);
+    call.pending = NULL;
 }
 
-/* Locks down the current zoom area
- */
-bool
-EZoomScreen::lockZoomAction (CompAction         *action,
-			    CompAction::State  state,
-			    CompOption::Vector options)
+void
+EZoomScreen::ExtentQuery::replied (DBusPendingCall *pending,
+				   void            *data)
 {
-    int out = screen->outputDeviceForPoint (pointerX, pointerY);
-    zooms.at (out).locked = !zooms.at (out).locked;
+    ExtentQuery *query = (ExtentQuery *) data;
+    DBusMessage *reply = dbus_pending_call_steal_reply (pending);
+    bool        caret = pending == query->calls[1].pending;
 
-    return true;
+    if (reply)
+    {
+	query->handleReply (caret, reply);
+	dbus_message_unref (reply);
+    }
 }
 
-/* Zoom to a specific level.
- * target defines the target zoom level.
- * First set the scale level and mark the display as grabbed internally (to
- * catch the FocusIn event). Either target the focused window or the mouse,
- * depending on settings.
- * FIXME: A bit of a mess...
- */
-bool
-EZoomScreen::zoomSpecific (CompAction         *action,
-			  CompAction::State  state,
-			  CompOption::Vector options,
-			  float		     target)
+/* Both reply with x, y, width and height; GetExtents as a struct */
+void
+EZoomScreen::ExtentQuery::handleReply (bool        caret,
+				       DBusMessage *reply)
 {
-    int          x, y;
-    int          out = screen->outputDeviceForPoint (pointerX, pointerY);
-    CompWindow   *w;
+    Call            &call = calls[caret ? 1 : 0];
+    DBusMessageIter iter, fields;
+    dbus_int32_t    v[4];
+    int             i;
 
-    if (target == 1.0f && zooms.at (out).newZoom == 1.0f)
-        return false;
-    if (screen->otherGrabExist (NULL))
-        return false;
+    AccessibleId id (call.id);
 
-    setScale (out, target);
+    dbus_pending_call_unref (call.pending);
+    call.pending = NULL;
 
-    w = screen->findWindow (screen->activeWindow ());
-    if (optionGetSpecTargetFocus ()
-        && w)
+    if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+	!dbus_message_iter_init (reply, &iter))
     {
-        areaToWindow (w);
+	errors++;
+	return;
     }
+
+    if (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRUCT)
+	dbus_message_iter_recurse (&iter, &fields);
     else
+	fields = iter;
+
+    for (i = 0; i < 4; i++)
     {
-        x = CompOption::getIntOptionNamed (options, "x", 0);
-        y = CompOption::getIntOptionNamed (options, "y", 0);
-        setCenter (x, y, false);
+	if (dbus_message_iter_get_arg_type (&fields) != DBUS_TYPE_INT32)
+	    break;
+
+	dbus_message_iter_get_basic (&fields, &v[i]);
+	dbus_message_iter_next (&fields);
     }
 
-    toggleFunctions (true);
+    if (i < 4)
+    {
+	errors++;
+	return;
+    }
 
-    return true;
-}
+    CompRect rect (v[0], v[1], v[2], v[3]);
 
-/* TODO: Add specific zoom boost::bind's */
+    if (!caret)
+    {
+	CacheEntry &entry = cacheEntry (id);
 
-/* Zooms to fit the active window to the screen without cutting
- * it off and targets it.
- */
-bool
-EZoomScreen::zoomToWindow (CompAction         *action,
-			  CompAction::State  state,
-			  CompOption::Vector options)
+	entry.extents = rect;
+	entry.hasExtents = true;
+    }
+
+    callback (id, rect, caret);
+}
+
+/* The cache entry of an accessible, evicting the least recently used one
+ * if the cache is full.  */
+EZoomScreen::ExtentQuery::CacheEntry &
+EZoomScreen::ExtentQuery::cacheEntry (const AccessibleId &id)
 {
-    int        width, height, out;
-    Window     xid;
-    CompWindow *w;
-    CompOutput *o;
+    std::map <AccessibleId, CacheEntry>::iterator it, oldest;
 
-    xid = CompOption::getIntOptionNamed (options, "window", 0);
-    w = screen->findWindow (xid);
-    if (!w)
-	return true;
-    width = w->width () + w->border ().left + w->border ().right;
-    height = w->height () + w->border ().top + w->border ().bottom;
-    out = screen->outputDeviceForGeometry (w->geometry ());
-    o = &screen->outputDevs ().at (out);
-    setScaleBigger (out, (float) width/o->width (),
-		    (float) height/o->height ());
-    areaToWindow (w);
-    toggleFunctions (true);
+    it = cache.find (id);
+    if (it == cache.end ())
+    {
+	if (cache.size () >= cacheSize)
+	{
+	    oldest = cache.begin ();
+	    for (it = cache.begin (); it != cache.end (); ++it)
+		if (it->second.used < oldest->second.used)
+		    oldest = it;
+	    cache.erase (oldest);
+	}
 
-    return true;
+	it = cache.insert (std::make_pair (id, CacheEntry ())).first;
+    }
+
+    it->second.used = ++useCount;
+
+    return it->second;
 }
 
-bool
-EZoomScreen::zoomPan (CompAction         *action,
-		     CompAction::State  state,
-		     CompOption::Vector options,
-		     float		horizAmount,
-		     float		vertAmount)
+unsigned int
+EZoomScreen::ExtentQuery::failed ()
 {
-    panZoom (horizAmount, vertAmount);
+    return errors;
+}
 
-    return true;
+/* Forget the extents of one accessible */
+void
+EZoomScreen::ExtentQuery::invalidate (const AccessibleId &id)
+{
+    cache.erase (id);
 }
 
-/* Centers the mouse based on zoom level and translation.
- */
-bool
-EZoomScreen::zoomCenterMouse (CompAction         *action,
-			     CompAction::State  state,
-			     CompOption::Vector options)
+/* Forget all extents, windows moved */
+void
+EZoomScreen::ExtentQuery::invalidateAll ()
 {
-    int        out;
+    cache.clear ();
+}
 
+unsigned int
+EZoomScreen::ExtentQuery::cacheHits ()
+{
+    return hits;
+}
 
-    out = screen->outputDeviceForPoint (pointerX, pointerY);
-    screen->warpPointer ((int) (screen->outputDevs ().at (out).width ()/2 +
-			screen->outputDevs ().at (out).x1 () - pointerX)
-			 + ((float) screen->outputDevs ().at (out).width () *
-				-zooms.at (out).xtrans),
-			 (int) (screen->outputDevs ().at (out).height ()/2 +
-				screen->outputDevs ().at (out).y1 () - pointerY)
-			 + ((float) screen->outputDevs ().at (out).height () *
-				zooms.at (out).ytrans));
-    return true;
+EZoomScreen::ProcessQuery::ProcessQuery ()
+{
 }
 
-/* Resize a window to fit the zoomed area.
- * This could probably do with some moving-stuff too.
- * IE: Move the zoom area afterwards. And ensure
- * the window isn't resized off-screen.
- */
-bool
-EZoomScreen::zoomFitWindowToZoom (CompAction         *action,
-			         CompAction::State  state,
-			         CompOption::Vector options)
+EZoomScreen::ProcessQuery::~ProcessQuery ()
 {
-    int            out;
-    unsigned int   mask = CWWidth | CWHeight;
-    XWindowChanges xwc;
-    CompWindow     *w;
+    cancel ();
+}
 
-    w = screen->findWindow (CompOption::getIntOptionNamed (
-							 options, "window", 0));
-    if (!w)
-	return true;
+void
+EZoomScreen::ProcessQuery::setCallback (const Callback &cb)
+{
+    callback = cb;
+}
+
+/* The process id of the application with this bus name, 0 if it can not
+ * be told or -1 while it is being asked for.  */
+int
+EZoomScreen::ProcessQuery::lookup (const CompString &bus)
+{
+    std::map <CompString, int>::iterator it = pids.find (bus);
+    DBusConnection                       *connection;
+    DBusMessage                          *message;
+    DBusPendingCall                      *pending = NULL;
+    const char                           *name = bus.c_str ();
+
+    if (it != pids.end ())
+	return it->second;
 
-    out = screen->outputDeviceForGeometry (w->geometry ());
-    xwc.x = w->serverX ();
-    xwc.y = w->serverY ();
-    xwc.width = (int) (screen->outputDevs ().at (out).width () *
-		       zooms.at (out).currentZoom -
-		       (int) ((w->border ().left + w->border ().right)));
-    xwc.height = (int) (screen->outputDevs ().at (out).height () *
-			zooms.at (out).currentZoom -
-			(int) ((w->border ().top + w->border ().bottom)));
+    /* Applications come and go, forget the ones not being asked for */
+    if (pids.size () >= cacheSize)
+    {
+	for (it = pids.begin (); it != pids.end ();)
+	{
+	    if (it->second >= 0)
+		pids.erase (it++);
+	    else
+		++it;
+	}
+    }
 
-    w->constrainNewWindowSize (xwc.width,
-			       xwc.height,
-			       &xwc.width,
-			       &xwc.height);
+    connection = atspi_get_a11y_bus ();
+    if (!connection)
+	return pids[bus] = 0;
 
+    message = dbus_message_new_method_call ("org.freedesktop.DBus",
+					    "/org/freedesktop/DBus",
+					    "org.freedesktop.DBus",
+					    "GetConnectionUnixProcessID");
+    if (!message)
+	return pids[bus] = 0;
 
-    if (xwc.width == w->serverWidth ())
-	mask &= ~CWWidth;
+    dbus_message_append_args (message, DBUS_TYPE_STRING, &name,
+			      DBUS_TYPE_INVALID);
 
-    if (xwc.height == w->serverHeight ())
-	mask &= ~CWHeight;
+    if (dbus_connection_send_with_reply (connection, message, &pending,
+					 callTimeout) && pending)
+    {
+	pids[bus] = -1;
+	calls[pending] = bus;
+	dbus_pending_call_set_notify (pending, &ProcessQuery::replied,
+				      this, NULL);
+    }
+    else
+	pids[bus] = 0;
 
-    if (w->mapNum () && (mask & (CWWidth | CWHeight)))
-	w->sendSyncRequest ();
+    dbus_message_unref (message);
 
-    w->configureXWindow (mask, &xwc);
+    return pids[bus];
+}
 
-    toggleFunctions (true);
+void
+EZoomScreen::ProcessQuery::cancel ()
+{
+    std::map <DBusPendingCall *, CompString>::iterator it;
 
-    return true;
+    for (it = calls.begin (); it != calls.end (); ++it)
+    {
+	dbus_pending_call_cancel (it->first);
+	dbus_pending_call_unref (it->first);
+	pids.erase (it->second);
+    }
+
+    calls.clear ();
 }
 
-bool
-EZoomScreen::initiate (CompAction         *action,
-		      CompAction::State  state,
-		      CompOption::Vector options)
+void
+EZoomScreen::ProcessQuery::replied (DBusPendingCall *pending,
+				    void            *data)
 {
-    zoomIn (action, state, options);
+    ProcessQuery  *query = (ProcessQuery *) data;
+    DBusMessage   *reply = dbus_pending_call_steal_reply (pending);
+    dbus_uint32_t pid = 0;
 
-    if (state & CompAction::StateInitKey)
-	action->setState (action->state () | CompAction::StateTermKey);
+    std::map <DBusPendingCall *, CompString>::iterator it =
+	query->calls.find (pending);
 
-    if (state & CompAction::StateInitButton)
-	action->setState (action->state () | CompAction::StateTermButton);
+    if (reply)
+    {
+	if (dbus_message_get_type (reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+	    dbus_message_get_args (reply, NULL, DBUS_TYPE_UINT32, &pid,
+				   DBUS_TYPE_INVALID);
+	dbus_message_unref (reply);
+    }
 
-    toggleFunctions (true);
+    if (it == query->calls.end ())
+	return;
 
-    return true;
+    query->pids[it->second] = pid;
+    query->calls.erase (it);
+    dbus_pending_call_unref (pending);
+
+    query->callback ();
+}
+
+/* TODO: Use this ctor carefully */
+
+EZoomScreen::CursorTexture::CursorTexture () :
+    isSet (false),
+    target (GL_TEXTURE_RECTANGLE_ARB),
+    serial (0)
+{
+}
+
+EZoomScreen::HardwareCursor::HardwareCursor () :
+    width (0),
+    height (0),
+    hotX (0),
+    hotY (0),
+    original (None),
+    installed (0)
+{
+}
+
+EZoomScreen::ThemeCursorKey::ThemeCursorKey (Atom             name,
+					     const CompString &theme,
+					     int              size,
+					     int              width,
+					     int              height,
+					     int              levels) :
+    name (name),
+    theme (theme),
+    size (size),
+    width (width),
+    height (height),
+    levels (levels)
+{
 }
 
 bool
-EZoomScreen::zoomOut (CompAction         *action,
-		     CompAction::State  state,
-		     CompOption::Vector options)
+EZoomScreen::ThemeCursorKey::operator< (const ThemeCursorKey &other) const
 {
-    int out = screen->outputDeviceForPoint (pointerX, pointerY);
+    if (name != other.name)
+	return name < other.name;
+    if (theme != other.theme)
+	return theme < other.theme;
+    if (size != other.size)
+	return size < other.size;
+    if (width != other.width)
+	return width < other.width;
+    if (height != other.height)
+	return height < other.height;
+    return levels < other.levels;
+}
 
-    setScale (out,
-	      zooms.at (out).newZoom *
-	      optionGetZoomFactor ());
+EZoomScreen::ThemeCursor::ThemeCursor () :
+    texture (0),
+    hotX (0),
+    hotY (0)
+{
+}
 
-    toggleFunctions (true);
+EZoomScreen::ThemeLoader::Job::Job () :
+    name (None),
+    size (0),
+    width (0),
+    height (0),
+    levels (0),
+    found (false),
+    hotX (0),
+    hotY (0)
+{
+}
 
-    return true;
+EZoomScreen::ThemeLoader::ThemeLoader () :
+    running (false),
+    quit (false)
+{
+    wakeFds[0] = wakeFds[1] = -1;
 }
 
 bool
-EZoomScreen::terminate (CompAction         *action,
-		       CompAction::State  state,
-		       CompOption::Vector options)
+EZoomScreen::ThemeLoader::start ()
 {
-    int out;
+    if (running)
+	return true;
 
-    out = screen->outputDeviceForPoint (pointerX, pointerY);
+    if (pipe (wakeFds) < 0)
+	return false;
 
-    if (grabbed)
+    fcntl (wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl (wakeFds[1], F_SETFL, O_NONBLOCK);
+    fcntl (wakeFds[0], F_SETFD, FD_CLOEXEC);
+    fcntl (wakeFds[1], F_SETFD, FD_CLOEXEC);
+
+    pthread_mutex_init (&mutex, NULL);
+    pthread_cond_init (&cond, NULL);
+    quit = false;
+
+    if (pthread_create (&thread, NULL, &ThemeLoader::run, this))
     {
-        zooms.at (out).newZoom = 1.0f;
-        cScreen->damageScreen ();
+	pthread_cond_destroy (&cond);
+	pthread_mutex_destroy (&mutex);
+	close (wakeFds[0]);
+	close (wakeFds[1]);
+	wakeFds[0] = wakeFds[1] = -1;
+	return false;
     }
 
-    toggleFunctions (true);
+    running = true;
+    return true;
+}
 
-    action->setState (action->state () & ~(CompAction::StateTermKey |
-					   CompAction::StateTermButton));
-    return false;
+/* Only ever waits for the file being read, the loader talks to nobody */
+void
+EZoomScreen::ThemeLoader::stop ()
+{
+    if (!running)
+	return;
 
+    pthread_mutex_lock (&mutex);
+    quit = true;
+    todo.clear ();
+    pthread_cond_signal (&cond);
+    pthread_mutex_unlock (&mutex);
+
+    pthread_join (thread, NULL);
+    pthread_cond_destroy (&cond);
+    pthread_mutex_destroy (&mutex);
+
+    close (wakeFds[0]);
+    close (wakeFds[1]);
+    wakeFds[0] = wakeFds[1] = -1;
+    done.clear ();
+    running = false;
 }
 
-/* Focus-track related event handling.
- * The lastMapped is a hack to ensure that newly mapped windows are
- * caught even if the grab that (possibly) triggered them affected
- * the mode. Windows created by a key binding (like creating a terminal
- * on a key binding) tends to trigger FocusIn events with mode other than
- * Normal. This works around this problem.
- * FIXME: Cleanup.
- * TODO: Avoid maximized windows.
- */
 void
-EZoomScreen::focusTrack (XEvent *event)
+EZoomScreen::ThemeLoader::load (const Job &job)
 {
-    int           out;
-    static Window lastMapped = 0;
+    pthread_mutex_lock (&mutex);
+    todo.push_back (job);
+    pthread_cond_signal (&cond);
+    pthread_mutex_unlock (&mutex);
+}
 
-    CompWindow    *w;
+bool
+EZoomScreen::ThemeLoader::pop (Job &job)
+{
+    bool found = false;
 
-    if (event->type == MapNotify)
+    pthread_mutex_lock (&mutex);
+    if (!done.empty ())
     {
-	lastMapped = event->xmap.window;
-	return;
+	job = done.front ();
+	done.pop_front ();
+	found = true;
     }
-    else if (event->type != FocusIn)
-	return;
+    pthread_mutex_unlock (&mutex);
 
-    if ((event->xfocus.mode != NotifyNormal)
-	&& (lastMapped != event->xfocus.window))
-	return;
+    return found;
+}
 
-    lastMapped = 0;
-    w = screen->findWindow (event->xfocus.window);
-    if (w == NULL || w->id () == screen->activeWindow ())
-	return;
+void
+EZoomScreen::ThemeLoader::drain ()
+{
+    char buf[64];
 
-    if (time(NULL) - lastChange < optionGetFollowFocusDelay () ||
-	!optionGetFollowFocus ())
-	return;
+    while (read (wakeFds[0], buf, sizeof (buf)) > 0);
+}
 
-    out = screen->outputDeviceForGeometry (w->geometry ());
-    if (!isActive (out) &&
-	!optionGetAlwaysFocusFitWindow ())
-	return;
-    if (optionGetFocusFitWindow ())
-    {
-	int width = w->width () + w->border ().left + w->border ().right;
-	int height = w->height () + w->border ().top + w->border ().bottom;
-	float scale = MAX ((float) width/screen->outputDevs ().at(out).width (),
-			   (float) height/screen->outputDevs ().at (out).height ());
-	if (scale > optionGetAutoscaleMin ())
-		setScale (out, scale);
-    }
+int
+EZoomScreen::ThemeLoader::fd ()
+{
+    return wakeFds[0];
+}
 
-    areaToWindow (w);
+void *
+EZoomScreen::ThemeLoader::run (void *data)
+{
+    ((ThemeLoader *) data)->loop ();
 
-    toggleFunctions (true);
+    return NULL;
 }
 
-
-/* Event handler. Pass focus-related events on and handle XFixes events. */
 void
-EZoomScreen::handleEvent (XEvent *event)
+EZoomScreen::ThemeLoader::loop ()
 {
+    for (;;)
+    {
+	Job  job;
+	char c = 0;
 
-    switch (event->type) {
-	case MotionNotify:
-	    if (grabIndex)
-	    {
-	        if (pointerX < clickPos.x ())
-	        {
-		    box.setX (pointerX);
-		    box.setWidth (clickPos.x () - pointerX);
-	        }
-	        else
-	        {
-		    box.setWidth (pointerX - clickPos.x ());
-	        }
+	pthread_mutex_lock (&mutex);
+	while (!quit && todo.empty ())
+	    pthread_cond_wait (&cond, &mutex);
 
-	        if (pointerY < clickPos.y ())
-	        {
-		    box.setY (pointerY);
-		    box.setHeight (clickPos.y () - pointerY);
-	        }
-	        else
-	        {
-		    box.setHeight (pointerY - clickPos.y ());
-	        }
-	        cScreen->damageScreen ();
-	    }
-	    break;
+	if (quit)
+	{
+	    pthread_mutex_unlock (&mutex);
+	    return;
+	}
 
-	case FocusIn:
-	case MapNotify:
-	    focusTrack (event);
-	    break;
-	default:
-	    if (event->type == fixesEventBase + XFixesCursorNotify)
-	    {
-		//XFixesCursorNotifyEvent *cev = (XFixesCursorNotifyEvent *)
-		    //event;
-		    if (cursor.isSet)
-			updateCursor (&cursor);
-	    }
-	    break;
-    }
+	job = todo.front ();
+	todo.pop_front ();
+	pthread_mutex_unlock (&mutex);
 
-    screen->handleEvent (event);
+	job.found = readCursor (job);
+
+	pthread_mutex_lock (&mutex);
+	done.push_back (job);
+	pthread_mutex_unlock (&mutex);
+
+	/* A full pipe already has a wakeup pending */
+	if (write (wakeFds[1], &c, 1) < 0)
+	    continue;
+    }
 }
 
-void
-EZoomScreen::handleAccessibilityEvent (AccessibilityEvent *event)
+/* Read the cursor and every mipmap level of it, scaling the nearest
+ * size for levels the theme does not have.  */
+bool
+EZoomScreen::ThemeLoader::readCursor (Job &job)
 {
-    AccessibleObject *object = event->getAccessibleObject ();
-    
-    compLogMessage ("EZoom", CompLogLevelInfo,
-                    "event->type: %s\n", event->getType());
+    XcursorImages *images;
+    XcursorImage  *base;
 
-    if (object->is (Component))
+    images = XcursorLibraryLoadImages (job.cursorName.c_str (),
+				       job.theme.c_str (), job.size);
+    if (!images)
+	return false;
+
+    base = images->images[0];
+
+    if (images->nimage != 1 ||
+	(int) base->width != job.width || (int) base->height != job.height)
     {
-        
-        AccessibilityComponent::Ptr ac = 
-            boost::static_pointer_cast<AccessibilityComponent>
-            (object->getEntity (Component));
+	XcursorImagesDestroy (images);
+	return false;
+    }
 
-        CompRect rect = ac->getExtents ();
+    job.hotX = base->xhot;
+    job.hotY = base->yhot;
+    job.images.resize (job.levels + 1);
 
-        compLogMessage ("Ezoom", CompLogLevelInfo,
-                        "ensureVisibilityArea [%d, %d] [%d, %d]\n",
-                        rect.x1(), rect.y1(), rect.x2(), rect.y2());
+    for (int level = 0; level <= job.levels; level++)
+    {
+	int                    scale = 1 << (job.levels - level);
+	int                    levelWidth = job.width * scale;
+	int                    levelHeight = job.height * scale;
+	XcursorImage           *image = base;
+	std::vector <uint32_t> &pixels = job.images[level];
+
+	if (scale > 1)
+	    image = XcursorLibraryLoadImage (job.cursorName.c_str (),
+					     job.theme.c_str (),
+					     job.size * scale);
+	if (!image)
+	    image = base;
+
+	pixels.resize (levelWidth * levelHeight);
+
+	if ((int) image->width == levelWidth &&
+	    (int) image->height == levelHeight)
+	    std::copy (image->pixels, image->pixels + pixels.size (),
+		       pixels.begin ());
+	else
+	    scaleCursorImage (image->pixels, image->width, image->height,
+			      &pixels[0], levelWidth, levelHeight);
 
-        if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
-        {
-            ensureVisibilityArea (rect.x1(),
-                                  rect.y1(),
-                                  rect.x2(),
-                                  rect.y2(),
-                                  optionGetRestrainMargin (),
-                                  NORTHWEST);
-        }
+	if (image != base)
+	    XcursorImageDestroy (image);
     }
 
-    if (object->is (Text))
-    {
-        AccessibilityText::Ptr at = 
-            boost::static_pointer_cast<AccessibilityText>
-            (object->getEntity (Text));
+    XcursorImagesDestroy (images);
 
-        CompRect rect = at->getCharacterExtents (at->getCaretOffset ());
+    return true;
+}
 
-        compLogMessage ("Ezoom", CompLogLevelInfo,
-                        "TEXT - [%d, %d] [%d, %d]\n",
-                        rect.x1(), rect.y1(), rect.x2(), rect.y2());
+EZoomScreen::Target::Target () :
+    pending (false),
+    window (None),
+    jump (false),
+    committed (false),
+    committedAt (0)
+{
+}
 
-        if (optionGetZoomMode () == EzoomOptions::ZoomModePanArea)
-        {
-            ensureVisibilityArea (rect.x1(),
-                                  rect.y1(),
-                                  rect.x2(),
-                                  rect.y2(),
-                                  optionGetRestrainMargin (),
-                                  NORTHWEST);
-        }
-    }
+EZoomScreen::CaretMotion::CaretMotion () :
+    valid (false),
+    stamp (0),
+    velocity (0.0f)
+{
 }
 
-/* TODO: Use this ctor carefully */
+EZoomScreen::AccessibilityStats::AccessibilityStats () :
+    received (0),
+    coalesced (0),
+    applied (0),
+    ignored (0),
+    reported (0),
+    publishedAt (0)
+{
+}
 
-EZoomScreen::CursorTexture::CursorTexture () :
-    isSet (false)
+EZoomScreen::SceneCache::SceneCache () :
+    isSet (false),
+    texture (0),
+    fbo (0),
+    width (0),
+    height (0)
+{
+}
+
+EZoomScreen::FrameCopy::FrameCopy () :
+    isSet (false),
+    texture (0),
+    width (0),
+    height (0),
+    panX (0),
+    panY (0),
+    zoom (1.0f)
 {
 }
 
@@ -1871,7 +5502,7 @@ EZoomScreen::postLoad ()
 
     toggleFunctions (true);
 
-    if (!pollHandle.active ())
+    if (!mousePollingActive ())
 	enableMousePolling ();
 
     foreach (ZoomArea &za, zooms)
@@ -1882,7 +5513,10 @@ EZoomScreen::postLoad ()
     cursorZoomActive (out);
     updateCursor (&cursor);
 
-    cScreen->damageScreen ();
+    /* zooms may still describe outputs that have gone away */
+    for (unsigned int i = 0;
+	 i < zooms.size () && i < screen->outputDevs ().size (); i++)
+	damageOutput (i);
 
 }
 
@@ -1895,7 +5529,27 @@ EZoomScreen::EZoomScreen (CompScreen *screen) :
     grabIndex (0),
     lastChange (0),
     cursorInfoSelected (false),
-    cursorHidden (false)
+    cursorHidden (false),
+    cursorRequestPending (false),
+    cursorName (None),
+    cursorSerial (0),
+    hwCursorActive (false),
+    hwLearnName (None),
+    hwLearnSerial (0),
+    hwVerifySerial (0),
+    cursorDamagePending (false),
+    damageIsZoomed (false),
+    rawMotionSelected (false),
+    pointerSamplePending (false),
+    settled (false),
+    a11yListener (NULL),
+    a11yPendingOffset (0),
+    a11yWindow (None),
+    a11yWindowPid (0),
+    a11yTextWindow (false),
+    a11yFocusSource (NULL),
+    focusWindow (None),
+    focusGrabWait (false)
 {
     ScreenInterface::setHandler (screen, false);
     CompositeScreenInterface::setHandler (cScreen, false);
@@ -1915,6 +5569,74 @@ EZoomScreen::EZoomScreen (CompScreen *screen) :
     else
 	canHideCursor = false;
 
+    canCacheScene = GL::fbo;
+
+    a11yStatsAtom = XInternAtom (screen->dpy (),
+				 "_COMPIZ_EZOOM_ACCESSIBILITY_STATS", 0);
+
+    unsigned int bestWidth, bestHeight;
+
+    if (XQueryBestCursor (screen->dpy (), screen->root (), 1024, 1024,
+			  &bestWidth, &bestHeight))
+	hwCursorMaxSize = MIN (bestWidth, bestHeight);
+    else
+	hwCursorMaxSize = 0;
+
+    /* Buffer objects, to stage cursor uploads through a pixel buffer
+     * object and to feed the overlay renderer */
+    const char *glExtensions = (const char *) glGetString (GL_EXTENSIONS);
+
+    cursorPbo = 0;
+    cursorPboMapped = false;
+    genBuffers = NULL;
+    deleteBuffers = NULL;
+    bindBuffer = NULL;
+    bufferData = NULL;
+    mapBuffer = NULL;
+    unmapBuffer = NULL;
+
+    if (glExtensions && strstr (glExtensions, "GL_ARB_vertex_buffer_object"))
+    {
+	genBuffers = (GenBuffersProc)
+	    (*GL::getProcAddress) ((GLubyte *) "glGenBuffersARB");
+	deleteBuffers = (DeleteBuffersProc)
+	    (*GL::getProcAddress) ((GLubyte *) "glDeleteBuffersARB");
+	bindBuffer = (BindBufferProc)
+	    (*GL::getProcAddress) ((GLubyte *) "glBindBufferARB");
+	bufferData = (BufferDataProc)
+	    (*GL::getProcAddress) ((GLubyte *) "glBufferDataARB");
+	mapBuffer = (MapBufferProc)
+	    (*GL::getProcAddress) ((GLubyte *) "glMapBufferARB");
+	unmapBuffer = (UnmapBufferProc)
+	    (*GL::getProcAddress) ((GLubyte *) "glUnmapBufferARB");
+
+	if (!genBuffers || !deleteBuffers || !bindBuffer ||
+	    !bufferData || !mapBuffer || !unmapBuffer)
+	    genBuffers = NULL;
+    }
+
+    if (genBuffers && strstr (glExtensions, "GL_ARB_pixel_buffer_object"))
+	(*genBuffers) (1, &cursorPbo);
+
+    initOverlay ();
+
+    /* The server only sends raw motion to the root window outside of
+     * grabs to clients that announced XI 2.1 or later. Compiz or another
+     * plugin may have announced a version on this display already, then
+     * XIQueryVersion says BadValue and hands back that version, which
+     * does as long as it is 2.1 or later. */
+    int xi2Event, xi2Error;
+    xi2Supported = XQueryExtension (screen->dpy (), "XInputExtension",
+				    &xi2Opcode, &xi2Event, &xi2Error);
+    if (xi2Supported)
+    {
+	int    major = 2, minor = 2;
+	Status status = XIQueryVersion (screen->dpy (), &major, &minor);
+
+	xi2Supported = (status == Success || status == BadValue) &&
+		       (major > 2 || (major == 2 && minor >= 1));
+    }
+
     n = screen->outputDevs ().size ();
 
     for (unsigned int i = 0; i < n; i++)
@@ -1926,14 +5648,37 @@ EZoomScreen::EZoomScreen (CompScreen *screen) :
 	zooms.push_back (za);
     }
 
+    sceneCaches.resize (zooms.size ());
+    frameCopies.resize (zooms.size ());
+
     pollHandle.setCallback (boost::bind (
 				&EZoomScreen::updateMouseInterval, this, _1));
 
-    a11yHandle = new Accessibility();
-    a11yHandle->registerEventHandler ("object:state-changed", boost::bind (
-                        &EZoomScreen::handleAccessibilityEvent, this, _1));
-    a11yHandle->registerEventHandler ("object:text-changed", boost::bind (
-                        &EZoomScreen::handleAccessibilityEvent, this, _1));
+    idleTimer.setCallback (boost::bind (&EZoomScreen::idleTimeout, this));
+    idleTimer.setTimes (500, 750);
+
+    motionTimer.setCallback (boost::bind (&EZoomScreen::rawMotionTimeout,
+					  this));
+    motionTimer.setTimes (0, 0);
+
+    a11yTimer.setCallback (boost::bind (
+			       &EZoomScreen::applyAccessibilityTargets, this));
+    extentQuery.setCallback (boost::bind (&EZoomScreen::handleExtents, this,
+					  _1, _2, _3));
+    a11yProcesses.setCallback (boost::bind (&EZoomScreen::followAccessibleApp,
+					    this));
+
+    cursorFetchWatch = screen->addWatchFd (
+			   xcb_get_file_descriptor (
+			       XGetXCBConnection (screen->dpy ())),
+			   POLLIN, boost::bind (
+			       &EZoomScreen::collectCursorImage, this));
+
+    a11yIdleTimer.setCallback (boost::bind (
+				   &EZoomScreen::disableAccessibility, this));
+
+    focusTimer.setCallback (boost::bind (&EZoomScreen::followFocus, this));
+    holdTimer.setCallback (boost::bind (&EZoomScreen::holdTimeout, this));
 
     optionSetZoomInButtonInitiate (boost::bind (&EZoomScreen::zoomIn, this, _1,
 						_2, _3));
@@ -1992,17 +5737,43 @@ EZoomScreen::~EZoomScreen ()
 {
     writeSerializedData ();
 
-    if (pollHandle.active ())
-	pollHandle.stop ();
+    disableMousePolling ();
+
+    idleTimer.stop ();
+
+    screen->removeWatchFd (cursorFetchWatch);
 
-    if (a11yHandle->active ())
-	a11yHandle->unregisterAll ();
+    disableAccessibility ();
+    XDeleteProperty (screen->dpy (), screen->root (), a11yStatsAtom);
+
+    for (unsigned int out = 0; out < zooms.size (); out++)
+    {
+	if (grabbed & (1 << zooms.at (out).output))
+	    damageOutput (out);
+    }
 
     if (zooms.size ())
 	zooms.clear ();
 
-    cScreen->damageScreen ();
+    foreach (SceneCache &sc, sceneCaches)
+	freeSceneCache (&sc);
+
+    foreach (FrameCopy &fc, frameCopies)
+	freeFrameCopy (&fc);
+
     cursorZoomInactive ();
+    freeHardwareCursors ();
+    trimCursorCache (0);
+
+    if (themeLoader.fd () >= 0)
+	screen->removeWatchFd (themeWatch);
+    themeLoader.stop ();
+    freeThemeCursors ();
+
+    if (cursorPbo)
+	(*deleteBuffers) (1, &cursorPbo);
+
+    finiOverlay ();
 }
 
 bool
@@ -44,12 +44,48 @@
 #include <composite/composite.h>
 #include <opengl/opengl.h>
 #include <mousepoll/mousepoll.h>
-#include <accessibility/accessibility.h>
+#include <atspi/atspi.h>
+#include <dbus/dbus.h>
+
+#include <X11/extensions/XInput2.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xfixes.h>
+#include <X11/Xcursor/Xcursor.h>
 
 
 #include "ezoom_options.h"
 
 #include <cmath>
+#include <map>
+#include <set>
+
+#include <pthread.h>
+
+#ifndef GL_PIXEL_UNPACK_BUFFER_ARB
+#define GL_PIXEL_UNPACK_BUFFER_ARB 0x88EC
+#endif
+#ifndef GL_STREAM_DRAW_ARB
+#define GL_STREAM_DRAW_ARB 0x88E0
+#endif
+#ifndef GL_WRITE_ONLY_ARB
+#define GL_WRITE_ONLY_ARB 0x88B9
+#endif
+#ifndef GL_ARRAY_BUFFER_ARB
+#define GL_ARRAY_BUFFER_ARB 0x8892
+#endif
+#ifndef GL_FRAGMENT_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#endif
+#ifndef GL_VERTEX_SHADER
+#define GL_VERTEX_SHADER 0x8B31
+#endif
+#ifndef GL_COMPILE_STATUS
+#define GL_COMPILE_STATUS 0x8B81
+#endif
+#ifndef GL_LINK_STATUS
+#define GL_LINK_STATUS 0x8B82
+#endif
 
 class EZoomScreen :
     public PluginClassHandler <EZoomScreen, CompScreen>,
@@ -86,20 +122,420 @@ class EZoomScreen :
 	    WEST
 	} ZoomEdge;
 
+	/* What can move the zoom area, see submitTarget () */
+	typedef enum {
+	    SourceMouse,
+	    SourceFocus,
+	    SourceCaret,
+	    SourceCount
+	} TargetSource;
+
+	/* Cursor images come with their name, so a reply can be told
+	 * apart from one for a cursor shown in the meantime */
+	typedef xcb_xfixes_get_cursor_image_and_name_reply_t
+		CursorImageReply;
+
+	/* GL_ARB_pixel_buffer_object entry points, the opengl plugin
+	 * does not resolve buffer objects for us */
+	typedef void (*GenBuffersProc) (GLsizei, GLuint *);
+	typedef void (*DeleteBuffersProc) (GLsizei, const GLuint *);
+	typedef void (*BindBufferProc) (GLenum, GLuint);
+	typedef void (*BufferDataProc) (GLenum, GLsizeiptr, const GLvoid *,
+					GLenum);
+	typedef GLvoid *(*MapBufferProc) (GLenum, GLenum);
+	typedef GLboolean (*UnmapBufferProc) (GLenum);
+
+	/* OpenGL 2.0 entry points for the overlay renderer */
+	typedef GLuint (*CreateShaderProc) (GLenum);
+	typedef void (*DeleteShaderProc) (GLuint);
+	typedef void (*ShaderSourceProc) (GLuint, GLsizei, const char **,
+					  const GLint *);
+	typedef void (*CompileShaderProc) (GLuint);
+	typedef void (*GetShaderivProc) (GLuint, GLenum, GLint *);
+	typedef GLuint (*CreateProgramProc) ();
+	typedef void (*DeleteProgramProc) (GLuint);
+	typedef void (*AttachShaderProc) (GLuint, GLuint);
+	typedef void (*BindAttribLocationProc) (GLuint, GLuint, const char *);
+	typedef void (*LinkProgramProc) (GLuint);
+	typedef void (*GetProgramivProc) (GLuint, GLenum, GLint *);
+	typedef void (*UseProgramProc) (GLuint);
+	typedef GLint (*GetUniformLocationProc) (GLuint, const char *);
+	typedef void (*Uniform1iProc) (GLint, GLint);
+	typedef void (*UniformMatrix4fvProc) (GLint, GLsizei, GLboolean,
+					      const GLfloat *);
+	typedef void (*EnableVertexAttribArrayProc) (GLuint);
+	typedef void (*DisableVertexAttribArrayProc) (GLuint);
+	typedef void (*VertexAttribPointerProc) (GLuint, GLint, GLenum,
+						 GLboolean, GLsizei,
+						 const GLvoid *);
+
 	class CursorTexture
 	{
 	    public:
 		bool       isSet;
 		GLuint     texture;
+		GLenum     target; // rectangle, or mipmapped 2D from the theme
 		CompScreen *screen;
 		int        width;
 		int        height;
 		int        hotX;
 		int        hotY;
+		unsigned long serial; // XFixes cursor serial, 0 if unknown
 	    public:
 		CursorTexture ();
 	};
 
+	/* A named cursor that can be replaced by scaled copies of itself,
+	 * for the hardware_cursor mode. pixels is the original image,
+	 * original a copy of it to put back when we are done.
+	 */
+	class HardwareCursor
+	{
+	    public:
+		CompString               name;
+		std::vector <uint32_t>   pixels;
+		int                      width;
+		int                      height;
+		int                      hotX;
+		int                      hotY;
+		Cursor                   original;
+		std::map <int, Cursor>   scaled; // by size bucket
+		std::set <unsigned long> serials; // of the scaled cursors
+		int                      installed; // bucket, 0 for original
+	    public:
+		HardwareCursor ();
+	};
+
+	/* A cursor from the cursor theme as a mipmapped 2D texture, see
+	 * loadThemeCursor. Kept apart from cursorCache, so it is read from
+	 * disk once per name and size however often that cursor comes
+	 * back. texture is 0 while it loads, or if the theme does not
+	 * have it.
+	 */
+	class ThemeCursorKey
+	{
+	    public:
+		Atom       name;
+		CompString theme;
+		int        size; // default cursor size of the theme
+		int        width;
+		int        height;
+		int        levels;
+	    public:
+		ThemeCursorKey (Atom             name,
+				const CompString &theme,
+				int              size,
+				int              width,
+				int              height,
+				int              levels);
+
+		bool
+		operator< (const ThemeCursorKey &other) const;
+	};
+
+	class ThemeCursor
+	{
+	    public:
+		GLuint texture;
+		int    hotX;
+		int    hotY;
+	    public:
+		ThemeCursor ();
+	};
+
+	/* Reads theme cursors and scales their mipmap levels on a thread
+	 * of its own, as that is disk I/O. The main loop queues a job with
+	 * load (), a byte on the pipe tells it to pop () the finished ones
+	 * and upload them.
+	 */
+	class ThemeLoader
+	{
+	    public:
+		class Job
+		{
+		    public:
+			Atom       name;
+			CompString cursorName;
+			CompString theme;
+			int        size;
+			int        width;
+			int        height;
+			int        levels;
+			bool       found;
+			int        hotX;
+			int        hotY;
+			std::vector <std::vector <uint32_t> > images; // per
+								   // level
+		    public:
+			Job ();
+		};
+
+	    public:
+		ThemeLoader ();
+
+		bool
+		start ();
+
+		void
+		stop ();
+
+		void
+		load (const Job &job);
+
+		bool
+		pop (Job &job);
+
+		void
+		drain ();
+
+		int
+		fd ();
+
+	    private:
+		static void *
+		run (void *data);
+
+		void
+		loop ();
+
+		static bool
+		readCursor (Job &job);
+
+		pthread_t        thread;
+		pthread_mutex_t  mutex;
+		pthread_cond_t   cond;
+		bool             running;
+		bool             quit; // protected by mutex
+		std::list <Job>  todo; // likewise
+		std::list <Job>  done; // likewise
+		int              wakeFds[2];
+	};
+
+	/* Offscreen copy of the unzoomed scene on one output. Only real
+	 * window damage is painted into it, zoom and pan animations just
+	 * sample it again with a different transform.
+	 */
+	class SceneCache
+	{
+	    public:
+		bool       isSet;
+		GLuint     texture;
+		GLuint     fbo;
+		int        width;
+		int        height;
+		CompRegion damage;
+	    public:
+		SceneCache ();
+	};
+
+	/* Copy of the last fully painted frame of a zoomed output, without
+	 * cursor or zoom box. panX/panY is the pan in whole pixels it was
+	 * painted with, damage is what changed below it since.
+	 */
+	class FrameCopy
+	{
+	    public:
+		bool       isSet;
+		GLuint     texture;
+		int        width;
+		int        height;
+		int        panX;
+		int        panY;
+		GLfloat    zoom;
+		CompRegion damage;
+	    public:
+		FrameCopy ();
+	};
+
+	/* Counters of accessibility events, for monitoring, see
+	 * publishAccessibilityStats. coalesced
+	 * are events replaced by a later one before they were followed,
+	 * ignored are targets of another application than the one of the
+	 * active window, or outside that window.  */
+	class AccessibilityStats
+	{
+	    public:
+		unsigned int received;
+		unsigned int coalesced;
+		unsigned int applied;
+		unsigned int ignored;
+		unsigned int reported; // coalesced when last logged
+		unsigned int publishedAt; // ms, see publishAccessibilityStats
+	    public:
+		AccessibilityStats ();
+	};
+
+	/* The latest target of one source, and when it last moved the
+	 * zoom area.  */
+	class Target
+	{
+	    public:
+		bool         pending;
+		CompRect     rect;
+		Window       window; // fit to it instead, or None
+		bool         jump; // go there at once, no animation
+		bool         committed; // ever
+		unsigned int committedAt; // ms, see currentMs ()
+	    public:
+		Target ();
+	};
+
+	/* Where the caret was last seen and how fast it moves along the
+	 * line, in pixels per millisecond.  */
+	class CaretMotion
+	{
+	    public:
+		bool         valid;
+		CompRect     last;
+		unsigned int stamp; // ms, see currentMs ()
+		float        velocity;
+	    public:
+		CaretMotion ();
+	};
+
+	/* An accessible object, by the bus name of its application and its
+	 * object path. Every event hands out a new AtspiAccessible, this is
+	 * what stays the same.  */
+	class AccessibleId
+	{
+	    public:
+		CompString bus;
+		CompString path;
+	    public:
+		AccessibleId ();
+		AccessibleId (AtspiAccessible *accessible);
+
+		bool
+		empty () const;
+
+		bool
+		operator< (const AccessibleId &other) const;
+	};
+
+	/* Looks up accessible extents with asynchronous calls on the
+	 * accessibility bus, as they are D-Bus round trips and a hung
+	 * application must not stall painting. The replies are dispatched
+	 * by the main loop along with the accessibility events and handed
+	 * to the callback. Only the latest focus and caret targets matter,
+	 * a newer request cancels the call still waiting for its answer.
+	 *
+	 * The extents looked up per accessible are kept until invalidate ()
+	 * or invalidateAll () says they moved. Character extents are not,
+	 * scrolling and editing move text without telling anyone.
+	 */
+	class ExtentQuery
+	{
+	    public:
+		typedef boost::function <void (const AccessibleId &,
+					       const CompRect &,
+					       bool)> Callback;
+
+		ExtentQuery ();
+		~ExtentQuery ();
+
+		void
+		setCallback (const Callback &cb);
+
+		bool
+		request (const AccessibleId &id,
+			 bool               caret,
+			 int                offset);
+
+		void
+		cancel ();
+
+		unsigned int
+		failed ();
+
+		void
+		invalidate (const AccessibleId &id);
+
+		void
+		invalidateAll ();
+
+		unsigned int
+		cacheHits ();
+
+	    private:
+		class CacheEntry
+		{
+		    public:
+			bool         hasExtents;
+			CompRect     extents;
+			unsigned int used;
+		    public:
+			CacheEntry ();
+		};
+
+		/* A call waiting for its reply */
+		class Call
+		{
+		    public:
+			DBusPendingCall *pending;
+			AccessibleId    id;
+		    public:
+			Call ();
+		};
+
+		static void
+		replied (DBusPendingCall *pending,
+			 void            *data);
+
+		void
+		handleReply (bool        caret,
+			     DBusMessage *reply);
+
+		void
+		cancel (Call &call);
+
+		CacheEntry &
+		cacheEntry (const AccessibleId &id);
+
+		static const unsigned int cacheSize = 64;
+		static const int          callTimeout = 1000; // ms
+
+		Callback                            callback;
+		Call                                calls[2]; // focus, caret
+		unsigned int                        errors; // and timeouts
+		unsigned int                        hits;
+		std::map <AccessibleId, CacheEntry> cache;
+		unsigned int                        useCount;
+	};
+
+	/* Which process an application on the accessibility bus is, as the
+	 * bus itself knows it. lookup () answers from what it was told
+	 * before and asks if it does not know yet, the callback runs once
+	 * the answer arrives.  */
+	class ProcessQuery
+	{
+	    public:
+		typedef boost::function <void ()> Callback;
+
+		ProcessQuery ();
+		~ProcessQuery ();
+
+		void
+		setCallback (const Callback &cb);
+
+		int
+		lookup (const CompString &bus);
+
+		void
+		cancel ();
+
+	    private:
+		static void
+		replied (DBusPendingCall *pending,
+			 void            *data);
+
+		static const unsigned int cacheSize = 256;
+		static const int          callTimeout = 1000; // ms
+
+		Callback                                 callback;
+		std::map <CompString, int>               pids; // by bus name
+		std::map <DBusPendingCall *, CompString> calls;
+	};
+
 	/* Stores an actual zoom-setup. This can later be used to store/restore
 	 * zoom areas on the fly.
 	 *
@@ -112,6 +548,10 @@ class EZoomScreen :
 	 * [xy]Translate, and [xy]trans is adjusted for the zoom level in place.
 	 * [xyz]trans should never be modified except in updateActualTranslates()
 	 *
+	 * [xyz]Velocity are in units per millisecond. The ease* members are
+	 * only used by the fixed duration motion model: the time left of the
+	 * current movement and the target it was started for.
+	 *
 	 * viewport is a mask of the viewport, or ~0 for "any".
 	 */
 	class ZoomArea
@@ -150,6 +590,11 @@ class EZoomScreen :
 		GLfloat           xtrans;
 		GLfloat           ytrans;
 		bool              locked;
+		GLfloat           easeXYTime;
+		GLfloat           easeZTime;
+		GLfloat           easeXTarget;
+		GLfloat           easeYTarget;
+		GLfloat           easeZTarget;
 	    public:
 
 		ZoomArea (int out);
@@ -174,18 +619,72 @@ class EZoomScreen :
 	CompPoint		 mouse; // we get this from mousepoll
 	unsigned long int	 grabbed;
 	CompScreen::GrabHandle   grabIndex; // for zoomBox
-	time_t			 lastChange;
+	unsigned int		 lastChange; // ms of the last mouse movement
 	CursorTexture		 cursor; // the texture for the faux-cursor
 					 // we paint to do fake input
 					 // handling
+	std::list <CursorTexture> cursorCache; // recently used cursors,
+					       // most recent first
 	bool			 cursorInfoSelected;
 	bool			 cursorHidden;
+	bool			 cursorRequestPending; // cursorCookie is valid
+	xcb_xfixes_get_cursor_image_and_name_cookie_t cursorCookie;
+	CompWatchFdHandle	 cursorFetchWatch; // X connection, for the
+						   // reply to cursorCookie
+	Atom			 cursorName; // of the current cursor, or None
+	unsigned long		 cursorSerial; // and its serial
+	std::map <Atom, CompString> cursorAtomNames;
+	std::map <Atom, HardwareCursor> hwCursors;
+	std::map <ThemeCursorKey, ThemeCursor> themeCursors;
+	ThemeLoader		 themeLoader;
+	CompWatchFdHandle	 themeWatch;
+	bool			 hwCursorActive; // the real cursor is scaled
+					         // and shown instead of ours
+	Atom			 hwLearnName; // waiting for this image
+	unsigned long		 hwLearnSerial; // of that very cursor
+	unsigned long		 hwVerifySerial; // maybe ours, waiting for
+						 // its image to tell
 	CompRect		 box;
 	CompPoint	         clickPos;
+	std::vector <SceneCache> sceneCaches; // one per output, only used
+					      // with cache_scene
+	std::vector <FrameCopy>  frameCopies; // one per output, only used
+					      // with pan_blit
+	CompRect		 lastCursorRect; // where the faux-cursor
+						 // was painted last
+	bool			 cursorDamagePending;
+	bool			 damageIsZoomed;
 
 	MousePoller		 pollHandle; // mouse poller object
-
-	Accessibility    *a11yHandle; // Accessibility object
+	CompTimer		 idleTimer; // stops pollHandle when settled
+	CompTimer		 motionTimer; // coalesces raw motion events
+	bool			 rawMotionSelected;
+	bool			 pointerSamplePending; // sample in preparePaint
+	bool			 settled; // zoomed, but nothing can move
+
+	AtspiEventListener	    *a11yListener; // NULL until enabled
+	AccessibleId		    a11yPendingFocus; // latest focus
+	AccessibleId		    a11yPendingCaret; // and caret targets
+	int			    a11yPendingOffset; // of that caret
+	CompTimer		    a11yTimer; // follows them once per frame
+	CompTimer		    a11yIdleTimer; // disconnects when unzoomed
+	CaretMotion		    caretMotion;
+	Target			    targets[SourceCount];
+	CompTimer		    holdTimer; // commits held targets
+	AccessibilityStats	    a11yStats;
+	Atom			    a11yStatsAtom;
+	ExtentQuery		    extentQuery;
+	ProcessQuery		    a11yProcesses;
+	Window			    a11yWindow; // active window the
+					        // subscriptions are for
+	int			    a11yWindowPid; // its _NET_WM_PID, or 0
+	bool			    a11yTextWindow; // it can be typed into
+	AtspiAccessible		    *a11yFocusSource; // latest focus, held
+	CompString		    a11yCaretBus; // application the caret
+						  // is listened for in
+	CompTimer		    focusTimer; // waits for focus to settle
+	Window			    focusWindow; // and where it went
+	bool			    focusGrabWait; // until a grab ends
 
      private:
 
@@ -193,6 +692,45 @@ class EZoomScreen :
 	int fixesEventBase;
 	int fixesErrorBase;
 	bool canHideCursor;
+	bool canCacheScene;
+	bool xi2Supported;
+	int xi2Opcode;
+	int hwCursorMaxSize;
+
+	GenBuffersProc    genBuffers;
+	DeleteBuffersProc deleteBuffers;
+	BindBufferProc    bindBuffer;
+	BufferDataProc    bufferData;
+	MapBufferProc     mapBuffer;
+	UnmapBufferProc   unmapBuffer;
+	GLuint cursorPbo; // staging buffer for cursor uploads, 0 if none
+	bool cursorPboMapped;
+	std::vector <unsigned char> cursorStaging; // used without a PBO
+
+	CreateShaderProc             createShader;
+	DeleteShaderProc             deleteShader;
+	ShaderSourceProc             shaderSource;
+	CompileShaderProc            compileShader;
+	GetShaderivProc              getShaderiv;
+	CreateProgramProc            createProgram;
+	DeleteProgramProc            deleteProgram;
+	AttachShaderProc             attachShader;
+	BindAttribLocationProc       bindAttribLocation;
+	LinkProgramProc              linkProgram;
+	GetProgramivProc             getProgramiv;
+	UseProgramProc               useProgram;
+	GetUniformLocationProc       getUniformLocation;
+	Uniform1iProc                uniform1i;
+	UniformMatrix4fvProc         uniformMatrix4fv;
+	EnableVertexAttribArrayProc  enableVertexAttribArray;
+	DisableVertexAttribArrayProc disableVertexAttribArray;
+	VertexAttribPointerProc      vertexAttribPointer;
+	GLuint overlayProgram[2]; // for rectangle and 2D textures, 0 if none
+	GLint  overlayProjection[2];
+	GLint  overlayTransform[2];
+	GLint  overlaySampler[2];
+	GLuint overlayVbo; // 0 if drawing in immediate mode
+	std::vector <GLfloat> overlayVertices;
 
      public:
 
@@ -212,11 +750,79 @@ class EZoomScreen :
 	void
 	donePaint ();
 
+	void
+	damageRegion (const CompRegion &);
+
 	void
 	handleEvent (XEvent *);
 
+	static void
+	accessibilityEvent (AtspiEvent *event,
+			    void       *data);
+
+	void
+	handleAccessibilityEvent (const AtspiEvent *event);
+
+	bool
+	followAccessibleRect (const CompRect &rect, bool caret);
+
+	CompRect
+	predictCaret (const CompRect &rect, bool &wrapped);
+
+	int
+	targetPriority (TargetSource source);
+
+	int
+	targetHold (TargetSource source);
+
+	unsigned int
+	targetHeld (TargetSource source);
+
+	void
+	scheduleHeldTargets ();
+
+	bool
+	holdTimeout ();
+
+	void
+	submitTarget (TargetSource   source,
+		      const CompRect &rect,
+		      Window         window,
+		      bool           jump);
+
+	void
+	commitTarget ();
+
+	void
+	scheduleAccessibilityTargets ();
+
+	bool
+	applyAccessibilityTargets ();
+
+	void
+	publishAccessibilityStats (bool force);
+
 	void
-	handleAccessibilityEvent (AccessibilityEvent *event);
+	requestAccessibleExtents (AccessibleId &id,
+				  bool         caret,
+				  int          offset);
+
+	bool
+	accessibleInActiveApp (const AccessibleId &id);
+
+	void
+	handleExtents (const AccessibleId &id,
+		       const CompRect     &rect,
+		       bool               caret);
+
+	void
+	subscribeAccessibility (AtspiAccessible *app);
+
+	void
+	followAccessibleApp ();
+
+	void
+	updateAccessibilitySubscriptions ();
 
     public:
 
@@ -226,11 +832,58 @@ class EZoomScreen :
 	bool
 	isInMovement (int out);
 
+	float
+	motionRate ();
+
+	void
+	animateZoom (int out, float msecs);
+
 	void
-	adjustZoomVelocity (int out, float chunk);
+	animateTranslate (int out, float msecs);
 
 	void
-	adjustXYVelocity (int out, float chunk);
+	damageZoomedRegion (const CompRegion &region);
+
+	void
+	damageOutput (int out);
+
+	CompRegion
+	boxRegion ();
+
+	void
+	freeSceneCache (SceneCache *cache);
+
+	bool
+	updateSceneCache (SceneCache *cache,
+			  CompOutput *output);
+
+	bool
+	paintSceneCache (const GLScreenPaintAttrib &attrib,
+			 const GLMatrix            &transform,
+			 const GLMatrix            &zTransform,
+			 CompOutput                *output,
+			 unsigned int              mask);
+
+	void
+	panOffset (int out, int *panX, int *panY);
+
+	void
+	freeFrameCopy (FrameCopy *copy);
+
+	bool
+	paintsOutputAlone ();
+
+	void
+	copyFrame (CompOutput *output, int panX, int panY);
+
+	bool
+	paintPanBlit (const GLScreenPaintAttrib &attrib,
+		      const GLMatrix            &transform,
+		      const GLMatrix            &zTransform,
+		      CompOutput                *output,
+		      unsigned int              mask,
+		      int                       panX,
+		      int                       panY);
 
 	void
 	drawBox (const GLMatrix &transform,
@@ -256,9 +909,36 @@ class EZoomScreen :
 	void
 	enableMousePolling ();
 
+	void
+	disableMousePolling ();
+
+	bool
+	mousePollingActive ();
+
+	bool
+	selectRawMotion (bool select);
+
+	bool
+	rawMotionTimeout ();
+
+	void
+	schedulePointerSample ();
+
+	void
+	settle ();
+
+	void
+	wakeUp ();
+
+	bool
+	idleTimeout ();
+
 	void
 	enableAccessibility ();
 
+	bool
+	disableAccessibility ();
+
 	void
 	setScale (int out, float value);
 
@@ -279,6 +959,19 @@ class EZoomScreen :
 			       int	  *resultX,
 			       int	  *resultY);
 
+	void
+	convertFromZoomed (int        out,
+			   int        x,
+			   int        y,
+			   int        *resultX,
+			   int        *resultY);
+
+	CompRegion
+	zoomedRegion (int out, const CompRegion &region);
+
+	CompRegion
+	unzoomedRegion (int out, const CompRegion &region);
+
 	bool
 	ensureVisibility (int x, int y, int margin);
 
@@ -306,13 +999,144 @@ class EZoomScreen :
 	void
 	freeCursor (CursorTexture * cursor);
 
+	float
+	cursorScaleFactor (int out);
+
+	CompRect
+	cursorRect ();
+
+	void
+	damageCursor ();
+
+	CompRect
+	zoomedBox (int      out,
+		   CompRect box);
+
+	GLuint
+	compileOverlayShader (GLenum     type,
+			      const char *prefix,
+			      const char *source);
+
+	void
+	initOverlay ();
+
+	void
+	finiOverlay ();
+
+	void
+	overlayQuad (float          x1,
+		     float          y1,
+		     float          x2,
+		     float          y2,
+		     float          s1,
+		     float          t1,
+		     float          s2,
+		     float          t2,
+		     bool           textured,
+		     const GLushort *color);
+
+	int
+	overlayProgramFor (GLenum target);
+
+	void
+	flushOverlay (const GLMatrix &transform,
+		      GLenum         target,
+		      GLuint         texture,
+		      bool           blend);
+
+	void
+	drawOverlay (const GLMatrix &transform,
+		     CompOutput     *output,
+		     bool           withCursor,
+		     bool           withBox);
+
 	void
 	drawCursor (CompOutput          *output,
 		    const GLMatrix      &transform);
 
+	bool
+	prepareCursorTexture (CursorTexture *cursor);
+
+	const CompString &
+	cursorAtomName (Atom name);
+
+	bool
+	loadThemeCursor (CursorTexture *cursor,
+			 Atom          name,
+			 int           width,
+			 int           height);
+
+	void
+	requestThemeCursor (const ThemeCursorKey &key);
+
+	void
+	handleThemeCursors ();
+
+	void
+	freeThemeCursors ();
+
 	void
 	updateCursor (CursorTexture * cursor);
 
+	void
+	setCursorImage (CursorTexture    *cursor,
+			CursorImageReply *ci);
+
+	void
+	requestCursorImage ();
+
+	void
+	cancelCursorRequest ();
+
+	void
+	collectCursorImage ();
+
+	unsigned char *
+	mapCursorStaging (unsigned int size);
+
+	void
+	uploadCursorStaging (CursorTexture *cursor,
+			     bool          reuseStorage);
+
+	void
+	switchCursor (unsigned long serial);
+
+	void
+	trimCursorCache (unsigned int size);
+
+	bool
+	hardwareCursorUsable (int out);
+
+	bool
+	shouldHideCursor (int out);
+
+	void
+	learnHardwareCursor (CursorImageReply *ci);
+
+	Cursor
+	makeHardwareCursor (HardwareCursor &hc,
+			    float          scale);
+
+	bool
+	installHardwareCursor (Atom           name,
+			       HardwareCursor &hc,
+			       int            bucket);
+
+	bool
+	ownHardwareCursor (unsigned long serial);
+
+	bool
+	verifyHardwareCursor (CursorImageReply *ci);
+
+	void
+	updateHardwareCursor (bool changed);
+
+	void
+	restoreHardwareCursors ();
+
+	void
+	freeHardwareCursors ();
+
 	void
 	cursorZoomInactive ();
 
@@ -396,6 +1220,9 @@ class EZoomScreen :
 
 	void
 	focusTrack (XEvent *event);
+
+	bool
+	followFocus ();
 };
 
 #define ZOOM_SCREEN(s)							       \